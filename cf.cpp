@@ -2,6 +2,7 @@
 // See the license at the end of this file
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -9,11 +10,16 @@
 #include <algorithm>
 #include <functional>
 #include <set>
+#include <typeinfo>
+#include <pthread.h>
+#include <unistd.h>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/xpressive/xpressive.hpp>
 #include "cf.h"
 
 // If defined, compiles as a test applicatation that tests
@@ -40,7 +46,48 @@ string escape(string s) {
   string r3 = replace_all_copy(r2, "\r", "\\r");
   return r3;
 }
+
+// Mark 'o' as a shared, immutable constant and keep it alive as a
+// garbage collector root. Used for objects the interpreter would
+// otherwise allocate afresh each time they are needed.
+template <class T>
+static T* constant(T* o) {
+  o->mImmutable = true;
+  GarbageCollector::GC.addRoot(o);
+  return o;
+}
+
+// The canonical empty list
+XYList* empty_list() {
+  static XYList* empty = constant(new XYList());
+  return empty;
+}
+
+// The symbols called by the data slot accessors that addSlot
+// makes. The interpreter recognises accessors by these.
+static XYSymbol* get_slot_value_symbol() {
+  static XYSymbol* symbol = constant(new XYSymbol("get-slot-value"));
+  return symbol;
+}
+
+static XYSymbol* set_slot_value_symbol() {
+  static XYSymbol* symbol = constant(new XYSymbol("set-slot-value"));
+  return symbol;
+}
  
+// Hash an integer value. Integers that fit in a long hash the
+// same as that long so that equal floats can match them.
+static size_t hash_mpz(mpz_class const& v) {
+  if (mpz_fits_slong_p(v.get_mpz_t()))
+    return hash_value(v.get_si());
+
+  size_t seed = mpz_sgn(v.get_mpz_t());
+  size_t limbs = mpz_size(v.get_mpz_t());
+  for (size_t i=0; i < limbs; ++i)
+    hash_combine(seed, mpz_getlimbn(v.get_mpz_t(), i));
+  return seed;
+}
+
 // Macro to implement double dispatch operations in class
 #define DD_IMPL(class, name)						\
   XYObject* class::name(XYObject* rhs) { return rhs->name(this); } \
@@ -212,57 +259,248 @@ static XYObject* dd_power(XYSequence* lhs, XYSequence* rhs) {
 }
 
 // XYSlot
-XYSlot::XYSlot(XYObject* method, XYObject* value, bool parent) :
+XYSlot::XYSlot(XYObject* method, XYObject* value) :
   mMethod(method),
-  mValue(value),
-  mParent(parent) 
+  mValue(value)
+{
+}
+
+// XYShape
+XYShape::XYShape() :
+  mDictionary(false)
+{
+}
+
+XYShape* XYShape::empty() {
+  static XYShape* empty = 0;
+  if (!empty) {
+    empty = new XYShape();
+    GarbageCollector::GC.addRoot(empty);
+  }
+  return empty;
+}
+
+void XYShape::markChildren() {
+  for (Transitions::iterator it = mTransitions.begin(); it != mTransitions.end(); ++it)
+    (*it).second->mark();
+}
+
+int XYShape::find(string const& name) const {
+  Offsets::const_iterator it = mOffsets.find(name);
+  return it == mOffsets.end() ? -1 : static_cast<int>((*it).second);
+}
+
+XYShape* XYShape::add(string const& name, bool parent) {
+  pair<string, bool> key(name, parent);
+  if (!mDictionary) {
+    Transitions::iterator it = mTransitions.find(key);
+    if (it != mTransitions.end())
+      return (*it).second;
+  }
+
+  XYShape* shape = dictionary();
+  shape->append(name, parent);
+  if (mDictionary ||
+      mNames.size() >= MAX_SHARED_SLOTS ||
+      mTransitions.size() >= MAX_TRANSITIONS)
+    return shape;
+
+  shape->mDictionary = false;
+  mTransitions[key] = shape;
+  return shape;
+}
+
+XYShape* XYShape::dictionary() const {
+  XYShape* shape = new XYShape();
+  shape->mOffsets = mOffsets;
+  shape->mNames = mNames;
+  shape->mParent = mParent;
+  shape->mParents = mParents;
+  shape->mDictionary = true;
+  return shape;
+}
+
+void XYShape::append(string const& name, bool parent) {
+  size_t index = mNames.size();
+  mOffsets[name] = index;
+  mNames.push_back(name);
+  mParent.push_back(parent);
+
+  // Parents are searched in name order
+  if (parent) {
+    vector<size_t>::iterator it = mParents.begin();
+    while (it != mParents.end() && mNames[*it] < name)
+      ++it;
+    mParents.insert(it, index);
+  }
+}
+
+void XYShape::remove(size_t index) {
+  assert(mDictionary);
+  assert(index < mNames.size());
+  mOffsets.erase(mNames[index]);
+  mNames.erase(mNames.begin() + index);
+  mParent.erase(mParent.begin() + index);
+
+  mParents.clear();
+  for (Offsets::iterator it = mOffsets.begin(); it != mOffsets.end(); ++it) {
+    if ((*it).second > index)
+      --(*it).second;
+    if (mParent[(*it).second])
+      mParents.push_back((*it).second);
+  }
+}
+
+// XYLookupCache
+unsigned long XYLookupCache::Epoch = 0;
+
+XYLookupCache::Entry::Entry() :
+  mShape(0),
+  mOwn(false),
+  mHolder(0),
+  mEpoch(0),
+  mIndex(0)
+{
+}
+
+XYLookupCache::XYLookupCache() :
+  mNext(0)
 {
 }
 
-void XYSlot::markChildren() {
-  if (mMethod)
-    mMethod->mark();
-  if (mValue)
-    mValue->mark();
+void XYLookupCache::markChildren() {
+  for (size_t i=0; i < SIZE; ++i) {
+    Entry& entry = mEntries[i];
+    if (entry.mShape)
+      entry.mShape->mark();
+    for (vector<XYObject*>::iterator it = entry.mParents.begin(); it != entry.mParents.end(); ++it)
+      (*it)->mark();
+    if (entry.mHolder)
+      entry.mHolder->mark();
+  }
+}
+
+// True if the parent slots of 'receiver' hold the objects in 'parents'
+static bool same_parents(XYObject* receiver, vector<XYObject*> const& parents) {
+  vector<size_t> const& indexes = receiver->mShape->mParents;
+  for (size_t i=0; i < indexes.size(); ++i) {
+    if (receiver->slotAt(indexes[i])->mValue != parents[i])
+      return false;
+  }
+  return true;
+}
+
+XYSlot* XYLookupCache::lookup(XYObject* receiver, string const& name, XYObject** context) {
+  if (name != mName) {
+    // A string naming a slot can be modified
+    for (size_t i=0; i < SIZE; ++i)
+      mEntries[i] = Entry();
+    mName = name;
+  }
+
+  XYShape* shape = receiver->mShape;
+  if (shape->mDictionary)
+    return receiver->lookup(name, context, true);
+
+  for (size_t i=0; i < SIZE; ++i) {
+    Entry& entry = mEntries[i];
+    if (entry.mShape != shape)
+      continue;
+
+    if (entry.mOwn) {
+      if (context)
+        *context = receiver;
+      return receiver->slotAt(entry.mIndex);
+    }
+
+    if (entry.mEpoch != Epoch || !same_parents(receiver, entry.mParents))
+      continue;
+
+    if (!entry.mHolder)
+      return 0;
+    if (context)
+      *context = entry.mHolder;
+    return entry.mHolder->slotAt(entry.mIndex);
+  }
+
+  // The receiver's slots are checked by its shape and parents.
+  // Changes to the other objects searched must change Epoch.
+  bool searched = receiver->mSearched;
+  XYObject* holder = 0;
+  XYSlot* slot = receiver->lookup(name, &holder, true);
+  receiver->mSearched = searched;
+
+  Entry& entry = mEntries[mNext];
+  mNext = (mNext + 1) % SIZE;
+  entry = Entry();
+  entry.mShape = shape;
+  entry.mOwn = slot && holder == receiver;
+  if (slot)
+    entry.mIndex = slot - holder->slotAt(0);
+  if (!entry.mOwn) {
+    vector<size_t> const& indexes = shape->mParents;
+    for (size_t i=0; i < indexes.size(); ++i)
+      entry.mParents.push_back(receiver->slotAt(indexes[i])->mValue);
+    entry.mHolder = slot ? holder : 0;
+    entry.mEpoch = Epoch;
+  }
+
+  if (slot && context)
+    *context = holder;
+  return slot;
 }
 
 // XYObject
-XYObject::XYObject() { }
+unsigned long XYObject::Visit = 0;
+
+XYObject::XYObject() : mShape(XYShape::empty()), mImmutable(false), mSearched(false), mVisit(0) { }
 
 void XYObject::markChildren() {
-  for (Slots::iterator it = mSlots.begin(); 
-       it != mSlots.end(); 
+  mShape->mark();
+  if (!mSlots)
+    return;
+  for (Slots::iterator it = mSlots->begin(); 
+       it != mSlots->end(); 
        ++it) {
-    (*it).second->mark();
+    if ((*it).mMethod)
+      (*it).mMethod->mark();
+    if ((*it).mValue)
+      (*it).mValue->mark();
   }
 }
 
 XYSlot* XYObject::lookup(std::string const& name, 
-			 std::set<XYObject*>& circular,
-			 XYObject** context) {
+			 XYObject** context,
+			 bool search) {
+  return lookup(name, ++Visit, context, search);
+}
+
+XYSlot* XYObject::lookup(std::string const& name, 
+			 unsigned long visit,
+			 XYObject** context,
+			 bool search) {
   assert(name.size() > 0);
 
-  if (circular.find(this) != circular.end())
+  if (mVisit == visit)
     return 0;
 
-  circular.insert(this);
+  mVisit = visit;
+  if (search)
+    mSearched = true;
 
-  Slots::iterator it = mSlots.find(name);
-  if (it == mSlots.end()) {
+  int index = mShape->find(name);
+  if (index < 0) {
     // Could not find name in the slots of this
     // object. Look for the name in the slots of
     // the parents.
-    for (Slots::iterator it = mSlots.begin();
-	 it != mSlots.end();
+    for (vector<size_t>::iterator it = mShape->mParents.begin();
+	 it != mShape->mParents.end();
 	 ++it) {
-      XYSlot* slot = (*it).second;
-      assert(slot);
-      if (slot->mParent) {
-	assert(slot->mValue);
-	XYSlot* found = slot->mValue->lookup(name, circular, context);
-	if (found)
-	  return found;
-      }
+      XYSlot& slot = *slotAt(*it);
+      assert(slot.mValue);
+      XYSlot* found = slot.mValue->lookup(name, visit, context, search);
+      if (found)
+        return found;
     }
     // Not found in any parent object, so slot does not exist
     return 0;
@@ -273,13 +511,13 @@ XYSlot* XYObject::lookup(std::string const& name,
   if (context)
     *context = this;
 
-  return (*it).second;
+  return slotAt(index);
 }
 
 XYSlot* XYObject::getSlot(string const& name) {
   assert(name.size() > 0);
-  assert(mSlots.find(name) != mSlots.end());
-  return mSlots[name];
+  int index = mShape->find(name);
+  return index < 0 ? 0 : slotAt(index);
 }
 
 void XYObject::addSlot(std::string const& name, 
@@ -288,16 +526,51 @@ void XYObject::addSlot(std::string const& name,
 		       bool parent) {
   assert(name.size() > 0);
   assert(method);
-  assert(mSlots.find(name) == mSlots.end());
+  assert(mShape->find(name) < 0);
 
-  mSlots[name] = new XYSlot(method, value, parent);
+  if (mSearched)
+    ++XYLookupCache::Epoch;
+  unshare();
+  if (mShape->mDictionary)
+    mShape->append(name, parent);
+  else
+    mShape = mShape->add(name, parent);
+  mSlots->push_back(XYSlot(method, value));
 }
   
 void XYObject::removeSlot(std::string const& name) {
   assert(name.size() > 0);
-  assert(mSlots.find(name) != mSlots.end());
-  
-  mSlots.erase(name);
+  int index = mShape->find(name);
+  assert(index >= 0);
+
+  if (mSearched)
+    ++XYLookupCache::Epoch;
+
+  // Objects rarely have slots removed, so rather than adding the
+  // shape without the slot to the shared ones it becomes our own.
+  unshare();
+  if (!mShape->mDictionary)
+    mShape = mShape->dictionary();
+  mShape->remove(index);
+  mSlots->erase(mSlots->begin() + index);
+}
+
+void XYObject::setSlotValue(size_t index, XYObject* value) {
+  assert(index < mShape->mNames.size());
+  unshare();
+  (*mSlots)[index].mValue = value;
+
+  // Changing a parent of an object that cached lookups searched
+  // changes what those lookups would find.
+  if (mSearched && mShape->mParent[index])
+    ++XYLookupCache::Epoch;
+}
+
+void XYObject::unshare() {
+  if (!mSlots)
+    mSlots = boost::make_shared<Slots>();
+  else if (!mSlots.unique())
+    mSlots = boost::make_shared<Slots>(*mSlots);
 }
 
 void XYObject::addSlot(std::string const& n, XYObject* value, bool readOnly) {
@@ -310,15 +583,16 @@ void XYObject::addSlot(std::string const& n, XYObject* value, bool readOnly) {
     name = name.substr(0, name.size() - 1);
     parent = true;
   }
+
   XYList* getter = new XYList();
   getter->mList.push_back(new XYString(name));
-  getter->mList.push_back(new XYSymbol("get-slot-value"));
+  getter->mList.push_back(get_slot_value_symbol());
   addSlot(name, getter, value, parent);
 
   if (!readOnly) {
     XYList* setter = new XYList();
     setter->mList.push_back(new XYString(name));
-    setter->mList.push_back(new XYSymbol("set-slot-value"));
+    setter->mList.push_back(set_slot_value_symbol());
     addSlot(name + ":", setter, 0, false);
   }
 }
@@ -341,25 +615,24 @@ void XYObject::addMethod(std::string const& name, XYList* method, XYSequence* ar
 void XYObject::addMethod(std::string const& name, XYPrimitive* method) {
   XYList* list = new XYList();
   list->mList.push_back(method);
-  addMethod(name, list, new XYList());
+  addMethod(name, list, empty_list());
 }
 
 void XYObject::addMethod(std::string const& name, XYObject* method) {
   // Convert the method to a quotation that does the work of cloning it,
   // install the frame, etc.
+  static XYSymbol* call_method = constant(new XYSymbol("call-method"));
+
   XYList* frameHandler = new XYList();
   frameHandler->mList.push_back(method);
-  frameHandler->mList.push_back(new XYSymbol("call-method"));
+  frameHandler->mList.push_back(call_method);
   addSlot(name, frameHandler, 0, false);
 }
 
 XYObject* XYObject::copy() const {
   XYObject* o = new XYObject();
-  for (Slots::const_iterator it = mSlots.begin();
-       it != mSlots.end();
-       ++it) {
-    o->mSlots[(*it).first] = new XYSlot(*((*it).second));
-  }
+  o->mShape = mShape->mDictionary ? mShape->dictionary() : mShape;
+  o->mSlots = mSlots;
   return o;
 }
 
@@ -374,26 +647,36 @@ void XYObject::print(ostringstream& stream, CircularSet& seen, bool parse) const
   else {
     seen.insert(this);
     stream << "(| ";
-    for (Slots::const_iterator it = mSlots.begin();
-	 it != mSlots.end();
+    for (XYShape::Offsets::const_iterator it = mShape->mOffsets.begin();
+	 it != mShape->mOffsets.end();
 	 ++it) {
       string name = (*it).first;
-      XYSlot* slot = (*it).second;
+      XYSlot const& slot = *slotAt((*it).second);
       stream << name;
-      if (slot->mParent)
+      if (mShape->mParent[(*it).second])
 	stream << '*';
       stream << "=";
-      if (slot->mValue) 
-	slot->mValue->print(stream, seen, parse);
+      if (slot.mValue) 
+	slot.mValue->print(stream, seen, parse);
       else
-	stream << "{" << slot->mMethod << "}";
+	stream << "{" << slot.mMethod << "}";
       stream << " ";
     }
     stream << "|)";
   }
 }
 
+// Ordering of objects of different types. Returns 0 if both
+// objects have the same rank and need a type specific comparison.
+static int compare_rank(XYObject const* lhs, XYObject const* rhs) {
+  return static_cast<int>(lhs->rank()) - static_cast<int>(rhs->rank());
+}
+
 int XYObject::compare(XYObject* rhs) {
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
   if (this < rhs)
     return -1;
   else if (this > rhs)
@@ -402,6 +685,14 @@ int XYObject::compare(XYObject* rhs) {
   return 0;
 }
 
+XYObject::Rank XYObject::rank() const {
+  return OBJECT_RANK;
+}
+
+size_t XYObject::hash() {
+  return hash_value(this);
+}
+
 string XYObject::toString(bool parse) const {
   CircularSet printed;
   ostringstream str;
@@ -492,6 +783,10 @@ XYObject* XYObject::power(XYSequence* rhs) {
 // XYNumber
 XYNumber::XYNumber(Type type) : mType(type) { }
 
+XYObject::Rank XYNumber::rank() const {
+  return NUMBER_RANK;
+}
+
 // XYFloat
 DD_IMPL(XYFloat, add)
 DD_IMPL(XYFloat, subtract)
@@ -509,16 +804,23 @@ void XYFloat::print(ostringstream& stream, CircularSet&, bool) const {
 }
 
 int XYFloat::compare(XYObject* rhs) {
-  XYFloat* o = dynamic_cast<XYFloat*>(rhs);
-  if (!o) {
-    XYInteger* i = dynamic_cast<XYInteger*>(rhs);
-    if (i)
-      return cmp(mValue, i->mValue);
-    else
-      return toString(true).compare(rhs->toString(true));
-  }
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  XYNumber* n = static_cast<XYNumber*>(rhs);
+  if (n->mType == INTEGER)
+    return cmp(mValue, static_cast<XYInteger*>(n)->mValue);
+
+  return cmp(mValue, static_cast<XYFloat*>(n)->mValue);
+}
 
-  return cmp(mValue, o->mValue);
+size_t XYFloat::hash() {
+  // Whole numbers must hash the same as the equal integer
+  if (mValue == ::floor(mValue))
+    return hash_mpz(mpz_class(mValue));
+
+  return hash_value(mValue.get_d());
 }
 
 bool XYFloat::is_zero() const {
@@ -557,16 +859,19 @@ void XYInteger::print(ostringstream& stream, CircularSet&, bool) const {
 }
 
 int XYInteger::compare(XYObject* rhs) {
-  XYInteger* o = dynamic_cast<XYInteger*>(rhs);
-  if (!o) {
-    XYFloat* f = dynamic_cast<XYFloat*>(rhs);
-    if (f)
-      return cmp(mValue, f->mValue);
-    else
-      return toString(true).compare(rhs->toString(true));
-  }
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  XYNumber* n = static_cast<XYNumber*>(rhs);
+  if (n->mType == FLOAT)
+    return cmp(mValue, static_cast<XYFloat*>(n)->mValue);
 
-  return cmp(mValue, o->mValue);
+  return cmp(mValue, static_cast<XYInteger*>(n)->mValue);
+}
+
+size_t XYInteger::hash() {
+  return hash_mpz(mValue);
 }
 
 bool XYInteger::is_zero() const {
@@ -590,7 +895,19 @@ XYNumber* XYInteger::floor() {
 }
 
 // XYSymbol
-XYSymbol::XYSymbol(string v) : mValue(v) { }
+XYSymbol::XYSymbol(string v) : mValue(v), mLookupCache(0) { }
+
+void XYSymbol::markChildren() {
+  XYObject::markChildren();
+  if (mLookupCache)
+    mLookupCache->mark();
+}
+
+XYSlot* XYSymbol::lookupSlot(XYObject* receiver, XYObject** context) {
+  if (!mLookupCache)
+    mLookupCache = new XYLookupCache();
+  return mLookupCache->lookup(receiver, mValue, context);
+}
 
 void XYSymbol::print(ostringstream& stream, CircularSet&, bool) const {
   stream << mValue;
@@ -609,10 +926,10 @@ void XYSymbol::eval1(XY* xy) {
   it = xy->mEnv.find("primitives");
   if (it != xy->mEnv.end()) {
     XYObject* p = (*it).second;
-    set<XYObject*> circular;
-    XYSlot* slot = p->lookup(mValue, circular, 0);
+    XYSlot* slot = lookupSlot(p, 0);
     if (slot) {
-      xy->mY.push_front(new XYSymbol("."));
+      static XYSymbol* unquote = constant(new XYSymbol("."));
+      xy->mY.push_front(unquote);
       xy->mY.push_front(slot->mMethod);
       xy->mY.push_front(p);
       return;
@@ -623,15 +940,43 @@ void XYSymbol::eval1(XY* xy) {
 }
 
 int XYSymbol::compare(XYObject* rhs) {
-  XYSymbol* o = dynamic_cast<XYSymbol*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  return mValue.compare(static_cast<XYSymbol*>(rhs)->mValue);
+}
 
-  return mValue.compare(o->mValue);
+XYObject::Rank XYSymbol::rank() const {
+  return SYMBOL_RANK;
+}
+
+size_t XYSymbol::hash() {
+  return hash_value(mValue);
 }
 
 // XYString
-XYString::XYString(string v) : mValue(v) { }
+XYString::XYString(string v) : mValue(v), mLookupCache(0) { }
+
+void XYString::markChildren() {
+  XYObject::markChildren();
+  if (mLookupCache)
+    mLookupCache->mark();
+}
+
+XYSlot* XYString::lookupSlot(XYObject* receiver, XYObject** context) {
+  if (!mLookupCache)
+    mLookupCache = new XYLookupCache();
+  return mLookupCache->lookup(receiver, mValue, context);
+}
+
+// A shared literal pushes a copy that can be modified
+void XYString::eval1(XY* xy) {
+  if (mImmutable)
+    xy->mX.push_back(new XYString(mValue));
+  else
+    xy->mX.push_back(this);
+}
 
 void XYString::print(ostringstream& stream, CircularSet&, bool parse) const {
   if (parse) {
@@ -643,11 +988,19 @@ void XYString::print(ostringstream& stream, CircularSet&, bool parse) const {
 }
 
 int XYString::compare(XYObject* rhs) {
-  XYString* o = dynamic_cast<XYString*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  return mValue.compare(static_cast<XYString*>(rhs)->mValue);
+}
+
+XYObject::Rank XYString::rank() const {
+  return STRING_RANK;
+}
 
-  return mValue.compare(o->mValue);
+size_t XYString::hash() {
+  return hash_value(mValue);
 }
 
 size_t XYString::size()
@@ -696,19 +1049,7 @@ XYSequence* XYString::join(XYSequence* rhs)
     return new XYString(mValue + rhs_string->mValue);
   }
 
-  XYSequence* self(dynamic_cast<XYSequence*>(this));
-
-  if (dynamic_cast<XYJoin const*>(rhs)) {
-    // Pointer is shared, we have to copy the data
-    XYJoin* join_rhs(dynamic_cast<XYJoin*>(rhs));
-    XYJoin* result(new XYJoin());
-    result->mSequences.push_back(self);
-    result->mSequences.insert(result->mSequences.end(), 
-			      join_rhs->mSequences.begin(), join_rhs->mSequences.end());
-    return result;
-  }
-
-  return new XYJoin(self, rhs);
+  return new XYJoin(this, rhs);
 }
 
 // XYShuffle
@@ -718,6 +1059,28 @@ XYShuffle::XYShuffle(string v) {
   assert(result.size() == 2);
   mBefore = result[0];
   mAfter  = result[1];
+
+  // Compile the pattern into the index of each item it pushes
+  assert(mBefore.size() <= 256);
+  mOrder.resize(mAfter.size());
+  for (size_t i=0; i < mAfter.size(); ++i) {
+    size_t n = mBefore.find(mAfter[i]);
+    assert(n != string::npos);
+    mOrder[i] = n;
+  }
+
+  size_t prefix = 0;
+  while (prefix < mOrder.size() && prefix < mBefore.size() && mOrder[prefix] == prefix)
+    ++prefix;
+
+  if (prefix == mOrder.size())
+    mShape = DROP;
+  else if (prefix == mBefore.size())
+    mShape = COPY;
+  else if (mBefore.size() == 2 && mAfter.size() == 2 && mOrder[0] == 1 && mOrder[1] == 0)
+    mShape = SWAP;
+  else
+    mShape = GENERAL;
 }
 
 void XYShuffle::print(ostringstream& stream, CircularSet&, bool) const {
@@ -725,25 +1088,69 @@ void XYShuffle::print(ostringstream& stream, CircularSet&, bool) const {
 }
 
 void XYShuffle::eval1(XY* xy) {
-  xy_assert(xy->mX.size() >= mBefore.size(), XYError::STACK_UNDERFLOW);
-  map<char, XYObject*> env;
-  for(string::reverse_iterator it = mBefore.rbegin(); it != mBefore.rend(); ++it) {
-    env[*it] = xy->mX.back();
-    xy->mX.pop_back();
-  }
+  size_t count = mBefore.size();
+  xy_assert(xy->mX.size() >= count, XYError::STACK_UNDERFLOW);
+  size_t base = xy->mX.size() - count;
+
+  switch (mShape) {
+  case DROP:
+    // a- ab-a
+    xy->mX.resize(base + mOrder.size());
+    break;
+
+  case COPY:
+    // a-aa ab-aba abc-abca
+    for (size_t i=count; i < mOrder.size(); ++i)
+      xy->mX.push_back(xy->mX[base + mOrder[i]]);
+    break;
+
+  case SWAP:
+    // ab-ba
+    swap(xy->mX[base], xy->mX[base + 1]);
+    break;
+
+  case GENERAL: {
+    // The items being shuffled are normally few enough to be
+    // held on the C++ stack while the stack is rewritten.
+    XYObject* local[16];
+    vector<XYObject*> heap;
+    XYObject** items = local;
+    if (count > 16) {
+      heap.resize(count);
+      items = &heap[0];
+    }
+    std::copy(xy->mX.begin() + base, xy->mX.end(), items);
 
-  for(string::iterator it = mAfter.begin(); it != mAfter.end(); ++it) {
-    assert(env.find(*it) != env.end());
-    xy->mX.push_back(env[*it]);
+    xy->mX.resize(base + mOrder.size());
+    for (size_t i=0; i < mOrder.size(); ++i)
+      xy->mX[base + i] = items[mOrder[i]];
+    break;
+  }
   }
 }
 
 int XYShuffle::compare(XYObject* rhs) {
-  XYShuffle* o = dynamic_cast<XYShuffle*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  XYShuffle* o = static_cast<XYShuffle*>(rhs);
+  int c = mBefore.compare(o->mBefore);
+  if (c != 0)
+    return c;
+
+  return mAfter.compare(o->mAfter);
+}
+
+XYObject::Rank XYShuffle::rank() const {
+  return SHUFFLE_RANK;
+}
 
-  return (mBefore + mAfter).compare(o->mBefore + o->mAfter);
+size_t XYShuffle::hash() {
+  size_t seed = 0;
+  hash_combine(seed, mBefore);
+  hash_combine(seed, mAfter);
+  return seed;
 }
 
 // XYSequence
@@ -754,17 +1161,25 @@ DD_IMPL(XYSequence, divide)
 DD_IMPL(XYSequence, power)
 
 int XYSequence::compare(XYObject* rhs) {
-  XYSequence* o = dynamic_cast<XYSequence*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
+  // Equal quotations are often the same object, such as when
+  // they are hash-consed.
+  if (this == rhs)
+    return 0;
 
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
+
+  XYSequence* o = static_cast<XYSequence*>(rhs);
   size_t lhs_len = size();
   size_t rhs_len = o->size();
   int li = 0;
   int ri = 0;
 
   for(li=0, ri=0;li < lhs_len && ri < rhs_len; ++li, ++ri) {
-    int c = at(li)->compare(o->at(ri));
+    XYObject* lhs_item = at(li);
+    XYObject* rhs_item = o->at(ri);
+    int c = lhs_item == rhs_item ? 0 : lhs_item->compare(rhs_item);
     if (c != 0)
       return c;
   }
@@ -778,17 +1193,37 @@ int XYSequence::compare(XYObject* rhs) {
   return 0;
 }
 
+bool XYSequence::empty() {
+  return size() == 0;
+}
+
+XYObject::Rank XYSequence::rank() const {
+  return SEQUENCE_RANK;
+}
+
+size_t XYSequence::hash() {
+  size_t seed = 0;
+  size_t len = size();
+  for (size_t i=0; i < len; ++i)
+    hash_combine(seed, at(i)->hash());
+  return seed;
+}
+
 // XYList
-XYList::XYList() { }
+XYList::XYList() : mPattern(0), mNative(0) { }
 
 template <class InputIterator>
-XYList::XYList(InputIterator first, InputIterator last) {
+XYList::XYList(InputIterator first, InputIterator last) : mPattern(0), mNative(0) {
   mList.assign(first, last);
 }
 
 void XYList::markChildren() {
   for (iterator it = mList.begin(); it != mList.end(); ++it)
     (*it)->mark();
+  if (mPattern)
+    mPattern->mark();
+  if (mNative)
+    mNative->mark();
 }
 
 void XYList::print(ostringstream& stream, CircularSet& seen, bool parse) const {
@@ -807,6 +1242,33 @@ void XYList::print(ostringstream& stream, CircularSet& seen, bool parse) const {
   }
 }
 
+// Returns 'o' with the shared lists and strings in it copied, so
+// the copy can be modified like a freshly parsed literal.
+static XYObject* copy_shared(XYObject* o) {
+  if (!o->mImmutable)
+    return o;
+
+  XYList* list = dynamic_cast<XYList*>(o);
+  if (list) {
+    XYList* copy(new XYList());
+    copy->mList.reserve(list->mList.size());
+    for (XYList::iterator it = list->mList.begin(); it != list->mList.end(); ++it)
+      copy->mList.push_back(copy_shared(*it));
+    return copy;
+  }
+
+  XYString* str = dynamic_cast<XYString*>(o);
+  if (str)
+    return new XYString(str->mValue);
+
+  return o;
+}
+
+// A shared literal pushes a copy that can be modified
+void XYList::eval1(XY* xy) {
+  xy->mX.push_back(copy_shared(this));
+}
+
 size_t XYList::size()
 {
   return mList.size();
@@ -837,20 +1299,13 @@ XYObject* XYList::head()
 XYSequence* XYList::tail()
 {
   if (mList.size() <= 1) 
-    return new XYList();
+    return empty_list();
 
   return new XYSlice(dynamic_cast<XYSequence*>(this), 1, mList.size());
 }
 
 XYSequence* XYList::join(XYSequence* rhs)
 {
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify the existing join
-    XYJoin* join_rhs = dynamic_cast<XYJoin*>(rhs);
-    join_rhs->mSequences.push_front(this);
-    return join_rhs;
-  }
-
   return new XYJoin(this, rhs);
 }
 
@@ -912,6 +1367,10 @@ XYObject* XYSlice::at(size_t n)
 void XYSlice::set_at(size_t n, XYObject* v)
 {
   assert(mBegin + n < mEnd);
+
+  // A slice of an immutable sequence must not change it
+  if (mOriginal->mImmutable)
+    throw XYError(0, XYError::IMMUTABLE, __FILE__, __LINE__);
   mOriginal->set_at(mBegin + n, v); 
 }
 
@@ -924,28 +1383,31 @@ XYObject* XYSlice::head()
 XYSequence* XYSlice::tail()
 {
   if (size() <= 1)
-    return new XYList();
+    return empty_list();
 
   return new XYSlice(mOriginal, mBegin+1, mEnd);
 }
 
 XYSequence* XYSlice::join(XYSequence* rhs)
 {
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify the existing join
-    XYJoin* join_rhs = dynamic_cast<XYJoin*>(rhs);
-    join_rhs->mSequences.push_front(this);
-    return join_rhs;
-  }
-
   return new XYJoin(this, rhs);
 }
 
 // XYJoin
 XYJoin::XYJoin(XYSequence* first, XYSequence* second)
 { 
-  mSequences.push_back(first);
-  mSequences.push_back(second);
+  append(first);
+  append(second);
+}
+
+void XYJoin::append(XYSequence* sequence)
+{
+  // Flatten nested joins so lookups stay a single level deep.
+  XYJoin* join = dynamic_cast<XYJoin*>(sequence);
+  if (join)
+    mSequences.insert(mSequences.end(), join->mSequences.begin(), join->mSequences.end());
+  else
+    mSequences.push_back(sequence);
 }
 
 void XYJoin::markChildren() {
@@ -1000,8 +1462,12 @@ void XYJoin::set_at(size_t n, XYObject* v)
   for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
     size_t b = s;
     s += (*it)->size();
-    if (n < s)
+    if (n < s) {
+      // A join of an immutable sequence must not change it
+      if ((*it)->mImmutable)
+        throw XYError(0, XYError::IMMUTABLE, __FILE__, __LINE__);
       return (*it)->set_at(n-b, v);
+    }
   }
 
   assert(1 == 0);
@@ -1022,24 +1488,105 @@ XYObject* XYJoin::head()
 XYSequence* XYJoin::tail()
 {
   if (size() <= 1)
-    return new XYList();
+    return empty_list();
 
   return new XYSlice(dynamic_cast<XYSequence*>(this), 1, size());
 }
 
 XYSequence* XYJoin::join(XYSequence* rhs)
 {
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify ourselves
-    XYJoin* join_rhs(dynamic_cast<XYJoin*>(rhs));
-    mSequences.insert(mSequences.end(), 
-		      mSequences.begin(), mSequences.end());
-    return this;
+  // Pointer is shared, we have to copy the data
+  return new XYJoin(this, rhs);
+}
+
+// XYRange
+XYRange::XYRange(long start, long stop, long step) :
+  mStart(start),
+  mStop(stop),
+  mStep(step)
+{
+  assert(mStep != 0);
+}
+
+void XYRange::markChildren() {
+  for (iterator it = mElements.begin(); it != mElements.end(); ++it)
+    (*it)->mark();
+}
+
+void XYRange::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (!mElements.empty()) {
+    stream << "[ ";
+    for (const_iterator it = mElements.begin(); it != mElements.end(); ++it) {
+      (*it)->print(stream, seen, parse);
+      stream << " ";
+    }
+    stream << "]";
+    return;
+  }
+
+  stream << "[ ";
+  for (long i = mStart; mStep > 0 ? i < mStop : i > mStop; i += mStep)
+    stream << i << " ";
+  stream << "]";
+}
+
+size_t XYRange::size()
+{
+  if (!mElements.empty())
+    return mElements.size();
+
+  if (mStep > 0)
+    return mStart < mStop ? (mStop - mStart + mStep - 1) / mStep : 0;
+
+  return mStart > mStop ? (mStart - mStop - mStep - 1) / -mStep : 0;
+}
+
+void XYRange::pushBackInto(List& list) {
+  size_t len = size();
+  for (size_t i = 0; i < len; ++i)
+    list.push_back(at(i));
+}
+
+XYObject* XYRange::at(size_t n)
+{
+  assert(n < size());
+  if (!mElements.empty())
+    return mElements[n];
+
+  return new XYInteger(mStart + static_cast<long>(n) * mStep);
+}
+
+void XYRange::set_at(size_t n, XYObject* v)
+{
+  assert(n < size());
+  if (mElements.empty()) {
+    List elements;
+    pushBackInto(elements);
+    mElements.swap(elements);
   }
 
-  // rhs is not a join
-  mSequences.push_back(rhs);
-  return this;
+  mElements[n] = v;
+}
+
+XYObject* XYRange::head()
+{
+  return at(0);
+}
+
+XYSequence* XYRange::tail()
+{
+  if (size() <= 1)
+    return empty_list();
+
+  if (!mElements.empty())
+    return new XYSlice(this, 1, mElements.size());
+
+  return new XYRange(mStart + mStep, mStop, mStep);
+}
+
+XYSequence* XYRange::join(XYSequence* rhs)
+{
+  return new XYJoin(this, rhs);
 }
 
 // XYPrimitive
@@ -1054,53 +1601,1386 @@ void XYPrimitive::eval1(XY* xy) {
 }
 
 int XYPrimitive::compare(XYObject* rhs) {
-  XYPrimitive* o = dynamic_cast<XYPrimitive*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
+  int r = compare_rank(this, rhs);
+  if (r != 0)
+    return r;
 
-  return mName.compare(o->mName);
+  return mName.compare(static_cast<XYPrimitive*>(rhs)->mName);
 }
- 
-// Primitive Implementations
 
-// + [X^lhs^rhs] Y] -> [X^lhs+rhs Y]
-static void primitive_addition(XY* xy) {
-  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
-  XYObject* rhs(xy->mX.back());
-  assert(rhs);
-  xy->mX.pop_back();
+XYObject::Rank XYPrimitive::rank() const {
+  return PRIMITIVE_RANK;
+}
 
-  XYObject* lhs(xy->mX.back());
-  assert(lhs);
-  xy->mX.pop_back();
+size_t XYPrimitive::hash() {
+  return hash_value(mName);
+}
 
-  xy->mX.push_back(lhs->add(rhs));
+// Returns true if the object is treated as false by conditionals.
+// Zero and the empty sequence are false, everything else is true.
+static bool is_false(XYObject* o) {
+  XYNumber* num(dynamic_cast<XYNumber*>(o));
+  XYSequence* seq(dynamic_cast<XYSequence*>(o));
+  return (num && num->is_zero()) || (seq && seq->empty());
 }
 
-// - [X^lhs^rhs] Y] -> [X^lhs-rhs Y]
-static void primitive_subtraction(XY* xy) {
-  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
-  XYObject* rhs(xy->mX.back());
-  assert(rhs);
-  xy->mX.pop_back();
+// An object to be sorted and the key it is ordered by. For a
+// plain sort these are the same object.
+typedef pair<XYObject*, XYObject*> SortItem;
+typedef vector<SortItem> SortItems;
 
-  XYObject* lhs(xy->mX.back());
-  assert(lhs);
-  xy->mX.pop_back();
+// Sequences at least this long are sorted using multiple threads
+static const size_t PARALLEL_SORT_THRESHOLD = 50000;
 
-  xy->mX.push_back(lhs->subtract(rhs));
+static bool sort_item_less(SortItem const& lhs, SortItem const& rhs) {
+  return lhs.first->compare(rhs.first) < 0;
 }
 
-// * [X^lhs^rhs] Y] -> [X^lhs*rhs Y]
-static void primitive_multiplication(XY* xy) {
-  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
-  XYObject* rhs(xy->mX.back());
-  assert(rhs);
-  xy->mX.pop_back();
+// Stable LSD radix sort, a byte at a time, of items whose keys
+// are all integers that fit in a long.
+static void radix_sort(SortItems& items) {
+  typedef pair<unsigned long, size_t> Key;
+  vector<Key> keys(items.size());
+  vector<Key> temp(items.size());
+  unsigned long const sign = 1UL << (sizeof(unsigned long) * 8 - 1);
+  for (size_t i=0; i < items.size(); ++i) {
+    XYInteger* n(static_cast<XYInteger*>(items[i].first));
+    // Flipping the sign bit makes negative numbers order first
+    keys[i] = Key(static_cast<unsigned long>(n->mValue.get_si()) ^ sign, i);
+  }
 
-  XYObject* lhs(xy->mX.back());
-  assert(lhs);
-  xy->mX.pop_back();
+  for (size_t shift=0; shift < sizeof(unsigned long) * 8; shift += 8) {
+    size_t counts[257] = { 0 };
+    for (size_t i=0; i < keys.size(); ++i)
+      ++counts[((keys[i].first >> shift) & 0xff) + 1];
+
+    // Skip bytes that are the same in every key. For small
+    // numbers this is most of them.
+    if (counts[((keys[0].first >> shift) & 0xff) + 1] == keys.size())
+      continue;
+
+    for (size_t i=1; i < 257; ++i)
+      counts[i] += counts[i - 1];
+    for (size_t i=0; i < keys.size(); ++i)
+      temp[counts[(keys[i].first >> shift) & 0xff]++] = keys[i];
+    keys.swap(temp);
+  }
+
+  SortItems sorted(items.size());
+  for (size_t i=0; i < keys.size(); ++i)
+    sorted[i] = items[keys[i].second];
+  items.swap(sorted);
+}
+
+// A range of items sorted or merged by a sorting thread
+struct SortRange {
+  SortItems* mItems;
+  size_t mBegin;
+  size_t mMiddle;
+  size_t mEnd;
+};
+
+static void* sort_range(void* arg) {
+  SortRange* r(static_cast<SortRange*>(arg));
+  stable_sort(r->mItems->begin() + r->mBegin,
+	      r->mItems->begin() + r->mEnd,
+	      sort_item_less);
+  return 0;
+}
+
+static void* merge_range(void* arg) {
+  SortRange* r(static_cast<SortRange*>(arg));
+  inplace_merge(r->mItems->begin() + r->mBegin,
+		r->mItems->begin() + r->mMiddle,
+		r->mItems->begin() + r->mEnd,
+		sort_item_less);
+  return 0;
+}
+
+// Run 'func' over each range, one thread per range.
+static void run_sort_threads(vector<SortRange>& ranges, void* (*func)(void*)) {
+  vector<pthread_t> threads(ranges.size());
+  vector<bool> started(ranges.size());
+  for (size_t i=0; i < ranges.size(); ++i)
+    started[i] = pthread_create(&threads[i], 0, func, &ranges[i]) == 0;
+
+  for (size_t i=0; i < ranges.size(); ++i) {
+    if (started[i])
+      pthread_join(threads[i], 0);
+    else
+      func(&ranges[i]);
+  }
+}
+
+// Stable merge sort using a thread per processor. Each thread sorts
+// a chunk and the chunks are then merged in pairs, in parallel,
+// until one remains. The keys must not allocate GC objects when
+// compared, so this is only used for numbers and strings.
+static void parallel_sort(SortItems& items) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t chunks = cpus > 1 ? cpus : 1;
+  if (chunks == 1) {
+    stable_sort(items.begin(), items.end(), sort_item_less);
+    return;
+  }
+
+  vector<size_t> bounds;
+  for (size_t i=0; i <= chunks; ++i)
+    bounds.push_back(items.size() * i / chunks);
+
+  vector<SortRange> ranges;
+  for (size_t i=0; i < chunks; ++i) {
+    SortRange r = { &items, bounds[i], bounds[i], bounds[i + 1] };
+    ranges.push_back(r);
+  }
+  run_sort_threads(ranges, sort_range);
+
+  while (bounds.size() > 2) {
+    vector<size_t> merged;
+    ranges.clear();
+    size_t i = 0;
+    for (i=0; i + 2 < bounds.size(); i += 2) {
+      SortRange r = { &items, bounds[i], bounds[i + 1], bounds[i + 2] };
+      ranges.push_back(r);
+      merged.push_back(bounds[i]);
+    }
+    // An odd chunk out is carried to the next round unmerged
+    if (i + 1 < bounds.size())
+      merged.push_back(bounds[i]);
+    merged.push_back(bounds.back());
+
+    run_sort_threads(ranges, merge_range);
+    bounds.swap(merged);
+  }
+}
+
+// Stable sort of the items by key, choosing the fastest safe method
+// for the keys that are present.
+static void sort_items(SortItems& items) {
+  bool integers = true;
+  bool numbers = true;
+  bool strings = true;
+  for (SortItems::iterator it = items.begin(); it != items.end(); ++it) {
+    XYObject* key = (*it).first;
+    XYInteger* n(dynamic_cast<XYInteger*>(key));
+    integers = integers && n && mpz_fits_slong_p(n->mValue.get_mpz_t());
+    numbers = numbers && dynamic_cast<XYNumber*>(key);
+    strings = strings && dynamic_cast<XYString*>(key);
+  }
+
+  if (integers && items.size() > 1)
+    radix_sort(items);
+  else if ((numbers || strings) && items.size() >= PARALLEL_SORT_THRESHOLD)
+    parallel_sort(items);
+  else
+    stable_sort(items.begin(), items.end(), sort_item_less);
+}
+
+// Returns a list of the elements of 'seq' sorted by the
+// corresponding elements of 'keys'.
+static XYList* sort_by_keys(XYSequence* seq, XYSequence* keys) {
+  SortItems items;
+  items.reserve(seq->size());
+  for (size_t i=0; i < seq->size(); ++i)
+    items.push_back(SortItem(keys->at(i), seq->at(i)));
+
+  sort_items(items);
+
+  XYList* result(new XYList());
+  result->mList.reserve(items.size());
+  for (SortItems::iterator it = items.begin(); it != items.end(); ++it)
+    result->mList.push_back((*it).second);
+  return result;
+}
+
+// XYIteration
+XYIteration::XYIteration(Type type,
+                         XYSequence* sequence,
+                         XYSequence* quotation,
+                         XYList* result,
+                         size_t index,
+                         size_t start) :
+  mType(type),
+  mSequence(sequence),
+  mQuotation(quotation),
+  mResult(result),
+  mIndex(index),
+  mStart(start),
+  mRest(0),
+  mSoFar(0)
+{
+}
+
+void XYIteration::start(XY* xy) {
+  XYObject* item = 0;
+  if (mType == SORT)
+    item = mSequence->at(mIndex);
+  else {
+    item = mSequence->head();
+    mRest = mSequence->tail();
+    xy->mX.push_back(mRest);
+    if (mResult) {
+      size_t end = mResult->mList.size();
+      if (mStart == end)
+        mSoFar = empty_list();
+      else
+        mSoFar = new XYSlice(mResult, mStart, end);
+      xy->mX.push_back(mSoFar);
+    }
+  }
+
+  xy->mX.push_back(item);
+  if (mType == FILTER)
+    xy->mX.push_back(item);
+  xy->mY.push_front(this);
+
+  XYSequence::List temp;
+  mQuotation->pushBackInto(temp);
+  xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());
+}
+
+void XYIteration::markChildren() {
+  mSequence->mark();
+  mQuotation->mark();
+  if (mResult)
+    mResult->mark();
+  if (mRest)
+    mRest->mark();
+  if (mSoFar)
+    mSoFar->mark();
+}
+
+void XYIteration::print(ostringstream& stream, CircularSet&, bool) const {
+  switch(mType) {
+  case MAP:
+    stream << "pmap";
+    break;
+
+  case FILTER:
+    stream << "pfilter";
+    break;
+
+  case EACH:
+    stream << "peach";
+    break;
+
+  case SORT:
+    stream << "sort-by";
+    break;
+  }
+  stream << "@" << mIndex;
+}
+
+// Adds 'o' in front of the results stored at the back of 'result'
+// from 'start', moving them to a larger list when there's no room.
+static void prepend_result(XYList*& result, size_t& start, XYObject* o) {
+  if (start == 0) {
+    size_t size = result->mList.size();
+    XYList* grown(new XYList());
+    grown->mList.resize(size * 2 + 16, empty_list());
+    start = grown->mList.size() - size;
+    copy(result->mList.begin(), result->mList.end(), grown->mList.begin() + start);
+    result = grown;
+  }
+  result->mList[--start] = o;
+}
+
+// Replaces the results with 'head', if there is one, followed by
+// 'rest' as the prelude's 'cons' would. Used when the quotation
+// leaves something other than the results so far on the stack.
+static void reset_results(XY* xy, XYList*& result, size_t& start, XYObject* head, XYObject* rest) {
+  XYSequence* seq(dynamic_cast<XYSequence*>(rest));
+  xy_assert(seq || head, XYError::TYPE);
+
+  XYSequence::List items;
+  if (head)
+    items.push_back(head);
+  if (seq)
+    seq->pushBackInto(items);
+  else
+    items.push_back(rest);
+
+  result = new XYList();
+  result->mList.resize(items.size() + 16, empty_list());
+  start = 16;
+  copy(items.begin(), items.end(), result->mList.begin() + start);
+}
+
+void XYIteration::eval1(XY* xy) {
+  if (mType == SORT) {
+    xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+    mResult->mList.push_back(xy->mX.back());
+    xy->mX.pop_back();
+
+    // A new object for each element, rather than incrementing our
+    // own index, so a continuation captured with '$' resumes from
+    // the correct element.
+    if (mIndex + 1 < mSequence->size())
+      (new XYIteration(mType, mSequence, mQuotation, mResult, mIndex + 1, 0))->start(xy);
+    else
+      xy->mX.push_back(sort_by_keys(mSequence, mResult));
+    return;
+  }
+
+  // Take the results and the rest of the sequence from the stack
+  // as the prelude definitions did, so the quotation can change them.
+  XYList* result = mResult;
+  size_t start = mStart;
+  XYObject* rest = 0;
+  switch(mType) {
+  case MAP: {
+    xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
+    XYObject* value(xy->mX.back());
+    xy->mX.pop_back();
+    XYObject* sofar(xy->mX.back());
+    xy->mX.pop_back();
+    rest = xy->mX.back();
+    xy->mX.pop_back();
+
+    if (sofar == mSoFar)
+      prepend_result(result, start, value);
+    else
+      reset_results(xy, result, start, value, sofar);
+    break;
+  }
+
+  case FILTER: {
+    xy_assert(xy->mX.size() >= 4, XYError::STACK_UNDERFLOW);
+    bool keep = !is_false(xy->mX.back());
+    xy->mX.pop_back();
+    XYObject* item(xy->mX.back());
+    xy->mX.pop_back();
+    XYObject* sofar(xy->mX.back());
+    xy->mX.pop_back();
+    rest = xy->mX.back();
+    xy->mX.pop_back();
+
+    if (sofar != mSoFar)
+      reset_results(xy, result, start, keep ? item : 0, sofar);
+    else if (keep)
+      prepend_result(result, start, item);
+    break;
+  }
+
+  case EACH:
+    xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+    rest = xy->mX.back();
+    xy->mX.pop_back();
+
+    // 'each' stops when the rest is false, whatever it is
+    if (is_false(rest))
+      return;
+    break;
+
+  case SORT:
+    break;
+  }
+
+  XYSequence* seq(dynamic_cast<XYSequence*>(rest));
+  xy_assert(seq, XYError::TYPE);
+
+  // A new object for each element so a continuation captured with
+  // '$' resumes from the correct element.
+  if (!seq->empty())
+    (new XYIteration(mType, seq, mQuotation, result, 0, start))->start(xy);
+  else if (result) {
+    // The results are stored most recent first
+    XYList* list(new XYList());
+    list->mList.assign(std::reverse_iterator<XYList::iterator>(result->mList.end()),
+                       std::reverse_iterator<XYList::iterator>(result->mList.begin() + start));
+    xy->mX.push_back(list);
+  }
+}
+
+// XYStreamChunk
+XYStreamChunk::XYStreamChunk(XY* xy,
+                             XYObject* seed,
+                             XYSequence* predicate,
+                             XYSequence* value,
+                             XYSequence* next,
+                             XYList* stack) :
+  mXY(xy),
+  mPredicate(predicate),
+  mValue(value),
+  mNext(next),
+  mStack(stack),
+  mSeed(seed),
+  mNextChunk(0)
+{
+}
+
+void XYStreamChunk::markChildren() {
+  mXY->mark();
+  mPredicate->mark();
+  mValue->mark();
+  mNext->mark();
+  mStack->mark();
+  if (mSeed)
+    mSeed->mark();
+  for (vector<XYObject*>::iterator it = mElements.begin(); it != mElements.end(); ++it)
+    (*it)->mark();
+  if (mNextChunk)
+    mNextChunk->mark();
+}
+
+bool XYStreamChunk::force(size_t n) {
+  assert(n < CAPACITY);
+  while (mElements.size() <= n && mSeed) {
+    XYObject* seed(mSeed);
+    if (!is_false(mXY->apply(seed, mPredicate, mStack))) {
+      mSeed = 0;
+      break;
+    }
+
+    mElements.push_back(mXY->apply(seed, mValue, mStack));
+    XYObject* next(mXY->apply(seed, mNext, mStack));
+    if (mElements.size() == CAPACITY) {
+      mNextChunk = new XYStreamChunk(mXY, next, mPredicate, mValue, mNext, mStack);
+      mSeed = 0;
+    }
+    else
+      mSeed = next;
+  }
+
+  return n < mElements.size();
+}
+
+// XYStream
+XYStream::XYStream(XYStreamChunk* chunk, size_t offset) :
+  mChunk(chunk),
+  mOffset(offset)
+{
+  assert(mOffset < XYStreamChunk::CAPACITY);
+}
+
+void XYStream::markChildren() {
+  mChunk->mark();
+}
+
+void XYStream::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  // Compute up to PRINT_LIMIT elements so a finite stream prints
+  // in full. Anything beyond that is only printed if it has already
+  // been computed, so printing an unbounded stream terminates. An
+  // error computing an element shows up when it is used instead.
+  try {
+    has(PRINT_LIMIT - 1);
+  }
+  catch (XYError&) {
+  }
+
+  stream << "[ ";
+  XYStreamChunk* chunk = mChunk;
+  size_t index = mOffset;
+  while (index < chunk->mElements.size()) {
+    chunk->mElements[index]->print(stream, seen, parse);
+    stream << " ";
+    if (++index == XYStreamChunk::CAPACITY && chunk->mNextChunk) {
+      chunk = chunk->mNextChunk;
+      index = 0;
+    }
+  }
+  if (chunk->mSeed || (index == XYStreamChunk::CAPACITY && chunk->mNextChunk))
+    stream << "... ";
+  stream << "]";
+}
+
+bool XYStream::locate(size_t n, XYStreamChunk*& chunk, size_t& index) const {
+  chunk = mChunk;
+  index = mOffset + n;
+  while (index >= XYStreamChunk::CAPACITY) {
+    if (!chunk->force(XYStreamChunk::CAPACITY - 1))
+      return false;
+    chunk = chunk->mNextChunk;
+    index -= XYStreamChunk::CAPACITY;
+  }
+
+  return chunk->force(index);
+}
+
+size_t XYStream::size()
+{
+  XYStreamChunk* chunk;
+  size_t index;
+  size_t n = 0;
+  while (locate(n, chunk, index))
+    ++n;
+
+  return n;
+}
+
+bool XYStream::has(size_t n) const
+{
+  XYStreamChunk* chunk;
+  size_t index;
+  return locate(n, chunk, index);
+}
+
+bool XYStream::empty()
+{
+  return !mChunk->force(mOffset);
+}
+
+void XYStream::pushBackInto(List& list) {
+  XYStreamChunk* chunk;
+  size_t index;
+  for (size_t i=0; locate(i, chunk, index); ++i)
+    list.push_back(chunk->mElements[index]);
+}
+
+XYObject* XYStream::at(size_t n)
+{
+  XYStreamChunk* chunk;
+  size_t index;
+  bool found = locate(n, chunk, index);
+  assert(found);
+  return chunk->mElements[index];
+}
+
+void XYStream::set_at(size_t n, XYObject* v)
+{
+  XYStreamChunk* chunk;
+  size_t index;
+  bool found = locate(n, chunk, index);
+  assert(found);
+  chunk->mElements[index] = v;
+}
+
+XYObject* XYStream::head()
+{
+  return at(0);
+}
+
+XYSequence* XYStream::tail()
+{
+  if (empty())
+    return empty_list();
+
+  if (mOffset + 1 < XYStreamChunk::CAPACITY)
+    return new XYStream(mChunk, mOffset + 1);
+
+  if (!mChunk->mNextChunk)
+    return empty_list();
+
+  return new XYStream(mChunk->mNextChunk, 0);
+}
+
+XYSequence* XYStream::join(XYSequence* rhs)
+{
+  return new XYJoin(this, rhs);
+}
+
+// XYDictionary
+XYDictionary::XYDictionary() :
+  mEntries(8),
+  mSize(0),
+  mFilled(0)
+{
+}
+
+void XYDictionary::markChildren() {
+  XYObject::markChildren();
+  for (Entries::iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+    if ((*it).mState == Entry::USED) {
+      (*it).mKey->mark();
+      (*it).mValue->mark();
+    }
+  }
+}
+
+XYObject* XYDictionary::copy() const {
+  XYDictionary* d(new XYDictionary());
+  d->mEntries = mEntries;
+  d->mSize = mSize;
+  d->mFilled = mFilled;
+  return d;
+}
+
+void XYDictionary::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (seen.find(this) != seen.end()) {
+    stream << "(circular)";
+  }
+  else {
+    seen.insert(this);
+    stream << "{| ";
+    for (Entries::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+      if ((*it).mState == Entry::USED) {
+	(*it).mKey->print(stream, seen, parse);
+	stream << "=";
+	(*it).mValue->print(stream, seen, parse);
+	stream << " ";
+      }
+    }
+    stream << "|}";
+  }
+}
+
+size_t XYDictionary::find(XYObject* key, size_t hash) {
+  // Spread the hash over the table so runs of integer keys
+  // don't cluster.
+  size_t mask = mEntries.size() - 1;
+  size_t i = (hash * 2654435761UL) & mask;
+  size_t removed = mEntries.size();
+
+  while (true) {
+    Entry& e = mEntries[i];
+    if (e.mState == Entry::EMPTY)
+      return removed != mEntries.size() ? removed : i;
+
+    if (e.mState == Entry::REMOVED) {
+      if (removed == mEntries.size())
+	removed = i;
+    }
+    else if (e.mHash == hash && e.mKey->compare(key) == 0)
+      return i;
+
+    i = (i + 1) & mask;
+  }
+}
+
+void XYDictionary::resize(size_t capacity) {
+  Entries old(capacity);
+  old.swap(mEntries);
+  mSize = 0;
+  mFilled = 0;
+  for (Entries::iterator it = old.begin(); it != old.end(); ++it) {
+    if ((*it).mState == Entry::USED) {
+      size_t i = find((*it).mKey, (*it).mHash);
+      mEntries[i] = *it;
+      ++mSize;
+      ++mFilled;
+    }
+  }
+}
+
+XYObject* XYDictionary::get(XYObject* key) {
+  Entry& e = mEntries[find(key, key->hash())];
+  return e.mState == Entry::USED ? e.mValue : 0;
+}
+
+void XYDictionary::put(XYObject* key, XYObject* value) {
+  // Keep the table at most three quarters full, counting
+  // removed entries, so probe sequences stay short.
+  if ((mFilled + 1) * 4 > mEntries.size() * 3)
+    resize(mSize * 2 >= mEntries.size() / 2 ? mEntries.size() * 2 : mEntries.size());
+
+  size_t hash = key->hash();
+  Entry& e = mEntries[find(key, hash)];
+  if (e.mState != Entry::USED) {
+    if (e.mState == Entry::EMPTY)
+      ++mFilled;
+    ++mSize;
+    e.mState = Entry::USED;
+    e.mHash = hash;
+    e.mKey = key;
+  }
+  e.mValue = value;
+}
+
+bool XYDictionary::remove(XYObject* key) {
+  Entry& e = mEntries[find(key, key->hash())];
+  if (e.mState != Entry::USED)
+    return false;
+
+  e.mState = Entry::REMOVED;
+  e.mKey = 0;
+  e.mValue = 0;
+  --mSize;
+  return true;
+}
+
+size_t XYDictionary::size() const {
+  return mSize;
+}
+
+void XYDictionary::keys(XYSequence::List& out) const {
+  for (Entries::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+    if ((*it).mState == Entry::USED)
+      out.push_back((*it).mKey);
+  }
+}
+
+// XYSet
+XYSet::XYSet() :
+  mIndex(new XYDictionary())
+{
+}
+
+void XYSet::markChildren() {
+  for (iterator it = mList.begin(); it != mList.end(); ++it)
+    (*it)->mark();
+  mIndex->mark();
+}
+
+void XYSet::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (seen.find(this) != seen.end()) {
+    stream << "(circular)";
+  }
+  else {
+    seen.insert(this);
+    stream << "[ ";
+    for (const_iterator it = mList.begin(); it != mList.end(); ++it) {
+      (*it)->print(stream, seen, parse);
+      stream << " ";
+    }
+
+    stream << "]";
+  }
+}
+
+size_t XYSet::size()
+{
+  return mList.size();
+}
+
+void XYSet::pushBackInto(List& list) {
+  list.insert(list.end(), mList.begin(), mList.end());
+}
+
+XYObject* XYSet::at(size_t n)
+{
+  assert(n < mList.size());
+  return mList[n];
+}
+
+void XYSet::set_at(size_t, XYObject*)
+{
+  // Sets are immutable. They can be reached through a slice or
+  // join so this is an error rather than an assertion.
+  throw XYError(0, XYError::IMMUTABLE, __FILE__, __LINE__);
+}
+
+XYObject* XYSet::head()
+{
+  assert(mList.size() > 0);
+  return mList[0];
+}
+
+XYSequence* XYSet::tail()
+{
+  if (mList.size() <= 1)
+    return empty_list();
+
+  return new XYSlice(this, 1, mList.size());
+}
+
+XYSequence* XYSet::join(XYSequence* rhs)
+{
+  return new XYJoin(this, rhs);
+}
+
+void XYSet::insert(XYObject* o) {
+  if (mIndex->get(o))
+    return;
+
+  mIndex->put(o, new XYInteger(static_cast<long>(mList.size())));
+  mList.push_back(o);
+}
+
+size_t XYSet::find(XYObject* o) {
+  XYInteger* index(static_cast<XYInteger*>(mIndex->get(o)));
+  if (!index)
+    return mList.size();
+
+  return index->as_uint();
+}
+
+// XYPattern
+XYPattern::XYPattern() { }
+
+void XYPattern::markChildren() {
+  for (Nodes::iterator it = mMatch.begin(); it != mMatch.end(); ++it)
+    (*it).mObject->mark();
+  for (Nodes::iterator it = mTemplate.begin(); it != mTemplate.end(); ++it)
+    (*it).mObject->mark();
+}
+
+// Add a node for 'object' to 'nodes', returning its index
+static size_t add_node(XYPattern::Nodes& nodes, XYPattern::Kind kind, XYObject* object) {
+  XYPattern::Node node;
+  node.mKind = kind;
+  node.mObject = object;
+  node.mVariable = -1;
+  node.mEnd = nodes.size() + 1;
+  nodes.push_back(node);
+  return nodes.size() - 1;
+}
+
+// A variable whose name is all uppercase matches the rest of a sequence
+static bool is_rest_variable(string const& name) {
+  return to_upper_copy(name) == name;
+}
+
+bool XYPattern::compileMatch(XYObject* object) {
+  XYList* list = dynamic_cast<XYList*>(object);
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(object);
+  if (list) {
+    size_t n = add_node(mMatch, LIST, list);
+    for (size_t i=0; i < list->mList.size(); ++i)
+      if (!compileMatch(list->mList[i]))
+        return false;
+    mMatch[n].mEnd = mMatch.size();
+  }
+  else if (dynamic_cast<XYSequence*>(object)) {
+    // Strings, slices, etc are rare as patterns. Leave them
+    // to the uncompiled matcher.
+    return false;
+  }
+  else if (symbol) {
+    size_t n = add_node(mMatch, is_rest_variable(symbol->mValue) ? REST : VARIABLE, symbol);
+    map<string, int>::iterator it = mVariables.find(symbol->mValue);
+    if (it == mVariables.end())
+      it = mVariables.insert(make_pair(symbol->mValue, static_cast<int>(mVariables.size()))).first;
+    mMatch[n].mVariable = (*it).second;
+  }
+  else
+    add_node(mMatch, OTHER, object);
+  return true;
+}
+
+void XYPattern::compileTemplate(XYObject* object) {
+  XYList* list = dynamic_cast<XYList*>(object);
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(object);
+  if (list) {
+    size_t n = add_node(mTemplate, LIST, list);
+    for (size_t i=0; i < list->mList.size(); ++i)
+      compileTemplate(list->mList[i]);
+    mTemplate[n].mEnd = mTemplate.size();
+  }
+  else if (dynamic_cast<XYSequence*>(object))
+    add_node(mTemplate, SEQUENCE, object);
+  else if (symbol && mVariables.find(symbol->mValue) != mVariables.end()) {
+    size_t n = add_node(mTemplate, VARIABLE, symbol);
+    mTemplate[n].mVariable = mVariables[symbol->mValue];
+  }
+  else
+    add_node(mTemplate, OTHER, object);
+}
+
+bool XYPattern::compile(XYSequence* pattern) {
+  mMatch.clear();
+  mTemplate.clear();
+  mItems.clear();
+  mVariables.clear();
+
+  assert(pattern->size() != 0);
+  if (!compileMatch(pattern->at(0)))
+    return false;
+  for (size_t i=1; i < pattern->size(); ++i) {
+    mItems.push_back(mTemplate.size());
+    compileTemplate(pattern->at(i));
+  }
+  return true;
+}
+
+// True if the items of 'sequence' from 'i' onwards are those the
+// nodes from 'first' to 'last' were compiled from.
+static bool unchanged_items(XYPattern::Nodes const& nodes,
+                            size_t first,
+                            size_t last,
+                            XYSequence* sequence,
+                            size_t i) {
+  for (size_t n = first; n < last; n = nodes[n].mEnd, ++i) {
+    XYPattern::Node const& node = nodes[n];
+    if (i >= sequence->size() || sequence->at(i) != node.mObject)
+      return false;
+    if (node.mKind == XYPattern::LIST &&
+        !unchanged_items(nodes, n + 1, node.mEnd, static_cast<XYList*>(node.mObject), 0))
+      return false;
+  }
+  return i == sequence->size();
+}
+
+bool XYPattern::unchanged(XYSequence* pattern) {
+  Node const& root = mMatch[0];
+  if (pattern->size() == 0 || pattern->at(0) != root.mObject)
+    return false;
+  if (root.mKind == LIST &&
+      !unchanged_items(mMatch, 1, root.mEnd, static_cast<XYList*>(root.mObject), 0))
+    return false;
+  return unchanged_items(mTemplate, 0, mTemplate.size(), pattern, 1);
+}
+
+void XYPattern::bind(XYObject** values, int variable, XYObject* value) {
+  // The first value bound to a variable is kept
+  if (!values[variable])
+    values[variable] = value;
+}
+
+// Match 'object', item 'i' of 'sequence', against node 'n'
+void XYPattern::match(XYObject** values, size_t n, XYObject* object, XYSequence* sequence, size_t i) {
+  Node const& node = mMatch[n];
+  switch (node.mKind) {
+  case VARIABLE:
+    bind(values, node.mVariable, object);
+    break;
+
+  case REST:
+    if (!values[node.mVariable])
+      bind(values, node.mVariable, new XYSlice(sequence, i, sequence->size()));
+    break;
+
+  case LIST: {
+    // An object that is not a sequence is matched as if it
+    // were a one element list.
+    XYSequence* list = dynamic_cast<XYSequence*>(object);
+    size_t size = list ? list->size() : 1;
+    size_t k = 0;
+    size_t c = n + 1;
+    for (; c < node.mEnd && k < size; c = mMatch[c].mEnd, ++k) {
+      if (list)
+        match(values, c, list->at(k), list, k);
+      else if (mMatch[c].mKind == REST) {
+        XYList* wrapped(new XYList());
+        wrapped->mList.push_back(object);
+        match(values, c, object, wrapped, k);
+      }
+      else
+        match(values, c, object, 0, k);
+    }
+
+    // Variables without a matching item are bound to an empty list.
+    // Each gets its own list, as getPatternValues did, so that the
+    // results are distinct objects.
+    for (; c < node.mEnd; c = mMatch[c].mEnd)
+      if (mMatch[c].mKind == VARIABLE || mMatch[c].mKind == REST)
+        bind(values, mMatch[c].mVariable, new XYList());
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// Copy a sequence in the template that wasn't compiled
+XYObject* XYPattern::replace(XYObject** values, XYObject* object) {
+  XYSequence* list = dynamic_cast<XYSequence*>(object);
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(object);
+  if (list) {
+    XYList* result(new XYList());
+    for (size_t i=0; i < list->size(); ++i)
+      result->mList.push_back(replace(values, list->at(i)));
+    return result;
+  }
+  else if (symbol) {
+    map<string, int>::iterator it = mVariables.find(symbol->mValue);
+    if (it != mVariables.end() && values[(*it).second])
+      return values[(*it).second];
+  }
+  return object;
+}
+
+// Returns the filled in copy of template node 'n'
+XYObject* XYPattern::fill(XYObject** values, size_t n) {
+  Node const& node = mTemplate[n];
+  switch (node.mKind) {
+  case LIST: {
+    XYList* result(new XYList());
+    for (size_t c = n + 1; c < node.mEnd; c = mTemplate[c].mEnd)
+      result->mList.push_back(fill(values, c));
+    return result;
+  }
+
+  case SEQUENCE:
+    return replace(values, node.mObject);
+
+  case VARIABLE:
+    // Unbound variables are left in place
+    return values[node.mVariable] ? values[node.mVariable] : node.mObject;
+
+  default:
+    return node.mObject;
+  }
+}
+
+void XYPattern::apply(XY* xy, bool queue) {
+  // Variables are few so their values are normally kept on
+  // the C++ stack.
+  XYObject* local[16] = { 0 };
+  vector<XYObject*> heap;
+  XYObject** values = local;
+  if (mVariables.size() > 16) {
+    heap.resize(mVariables.size());
+    values = &heap[0];
+  }
+
+  Node const& root = mMatch[0];
+  if (root.mKind == LIST) {
+    // Match the items on the top of the stack
+    size_t count = 0;
+    for (size_t c = 1; c < root.mEnd; c = mMatch[c].mEnd)
+      ++count;
+    xy_assert(xy->mX.size() >= count, XYError::STACK_UNDERFLOW);
+
+    size_t base = xy->mX.size() - count;
+    XYList* stack = 0;
+    size_t k = 0;
+    for (size_t c = 1; c < root.mEnd; c = mMatch[c].mEnd, ++k) {
+      if (mMatch[c].mKind == REST && !stack)
+        stack = new XYList(xy->mX.begin() + base, xy->mX.end());
+      match(values, c, xy->mX[base + k], stack, k);
+    }
+    xy->mX.resize(base);
+  }
+  else {
+    xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+    XYObject* o = xy->mX.back();
+    xy->mX.pop_back();
+    if (root.mKind == REST)
+      bind(values, root.mVariable, new XYSlice(new XYList(), 0, 0));
+    else
+      match(values, 0, o, 0, 0);
+  }
+
+  if (queue) {
+    for (vector<size_t>::reverse_iterator it = mItems.rbegin(); it != mItems.rend(); ++it)
+      xy->mY.push_front(fill(values, *it));
+  }
+  else {
+    for (vector<size_t>::iterator it = mItems.begin(); it != mItems.end(); ++it)
+      xy->mX.push_back(fill(values, *it));
+  }
+}
+
+// XYParseCache
+XYParseCache::XYParseCache(size_t limit) :
+  mBytes(0),
+  mLimit(limit),
+  mHits(0),
+  mMisses(0)
+{
+}
+
+void XYParseCache::markChildren() {
+  for (Entries::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+    (*it).second.mProgram->mark();
+}
+
+// Copy an object produced by the parser, adding the approximate
+// memory used by the copy to 'bytes'. Lists and strings can be
+// modified by cf code, and any object can have slots added, so
+// every object is copied.
+static XYObject* copy_parsed(XYObject* o, size_t& bytes) {
+  type_info const& type = typeid(*o);
+  if (type == typeid(XYList)) {
+    XYList* list = static_cast<XYList*>(o);
+    XYList* result(new XYList());
+    for (XYList::iterator it = list->mList.begin(); it != list->mList.end(); ++it)
+      result->mList.push_back(copy_parsed(*it, bytes));
+    bytes += sizeof(XYList) + list->mList.size() * sizeof(XYObject*);
+    return result;
+  }
+  if (type == typeid(XYString)) {
+    bytes += sizeof(XYString) + static_cast<XYString*>(o)->mValue.size();
+    return new XYString(*static_cast<XYString*>(o));
+  }
+  if (type == typeid(XYInteger)) {
+    bytes += sizeof(XYInteger);
+    return new XYInteger(*static_cast<XYInteger*>(o));
+  }
+  if (type == typeid(XYFloat)) {
+    bytes += sizeof(XYFloat);
+    return new XYFloat(*static_cast<XYFloat*>(o));
+  }
+  if (type == typeid(XYSymbol)) {
+    bytes += sizeof(XYSymbol) + static_cast<XYSymbol*>(o)->mValue.size();
+    return new XYSymbol(*static_cast<XYSymbol*>(o));
+  }
+  if (type == typeid(XYShuffle)) {
+    bytes += sizeof(XYShuffle);
+    return new XYShuffle(*static_cast<XYShuffle*>(o));
+  }
+
+  // The parser creates no other objects
+  assert(1 == 0);
+  return o;
+}
+
+XYList* XYParseCache::find(string const& key) {
+  Entries::iterator it = mEntries.find(key);
+  if (it == mEntries.end()) {
+    ++mMisses;
+    return 0;
+  }
+
+  ++mHits;
+  Entry& entry = (*it).second;
+  mOrder.splice(mOrder.begin(), mOrder, entry.mPosition);
+
+  size_t bytes = 0;
+  return static_cast<XYList*>(copy_parsed(entry.mProgram, bytes));
+}
+
+void XYParseCache::insert(string const& key, XYList* program) {
+  if (mEntries.find(key) != mEntries.end())
+    return;
+
+  Entry entry;
+  entry.mBytes = sizeof(Entry) + key.size() * 2;
+  entry.mProgram = static_cast<XYList*>(copy_parsed(program, entry.mBytes));
+  if (entry.mBytes > mLimit)
+    return;
+
+  // Discard the least recently used entries to make room
+  while (mBytes + entry.mBytes > mLimit) {
+    Entries::iterator last = mEntries.find(mOrder.back());
+    mBytes -= (*last).second.mBytes;
+    mEntries.erase(last);
+    mOrder.pop_back();
+  }
+
+  mOrder.push_front(key);
+  entry.mPosition = mOrder.begin();
+  mEntries[key] = entry;
+  mBytes += entry.mBytes;
+}
+
+// XYInterner
+XYInterner::XYInterner(size_t limit) :
+  mLimit(limit)
+{
+}
+
+void XYInterner::markChildren() {
+  for (Objects::iterator it = mObjects.begin(); it != mObjects.end(); ++it)
+    (*it).second->mark();
+}
+
+XYObject* XYInterner::intern(XYObject* o) {
+  type_info const& type = typeid(*o);
+  string key;
+  if (type == typeid(XYList)) {
+    XYList* list = static_cast<XYList*>(o);
+    key = "l";
+    for (XYList::iterator it = list->mList.begin(); it != list->mList.end(); ++it) {
+      *it = intern(*it);
+      key.append(reinterpret_cast<char const*>(&*it), sizeof(XYObject*));
+    }
+  }
+  else if (type == typeid(XYString))
+    key = "s" + static_cast<XYString*>(o)->mValue;
+  else if (type == typeid(XYInteger))
+    key = "i" + static_cast<XYInteger*>(o)->mValue.get_str(16);
+  else if (type == typeid(XYFloat)) {
+    mp_exp_t exponent;
+    key = "f" + static_cast<XYFloat*>(o)->mValue.get_str(exponent, 16);
+    key += "e" + lexical_cast<string>(exponent);
+  }
+  else if (type == typeid(XYSymbol))
+    key = "y" + static_cast<XYSymbol*>(o)->mValue;
+  else if (type == typeid(XYShuffle))
+    key = "h" + static_cast<XYShuffle*>(o)->mBefore + "-" + static_cast<XYShuffle*>(o)->mAfter;
+  else
+    return o;
+
+  Objects::iterator it = mObjects.find(key);
+  if (it != mObjects.end())
+    return (*it).second;
+
+  // Objects already handed out stay shared, later ones start afresh
+  if (mObjects.size() >= mLimit)
+    mObjects.clear();
+
+  o->mImmutable = true;
+  mObjects[key] = o;
+  return o;
+}
+
+// Replace the objects in [first, last) by their canonical objects
+// if hash-consing is on.
+template <class Iterator>
+static void intern(XY* xy, Iterator first, Iterator last) {
+  if (!xy->mInterner)
+    return;
+
+  for (; first != last; ++first)
+    *first = xy->mInterner->intern(*first);
+}
+
+// XYNative
+XYNative::XYNative(XY* xy, XYNativeFunction function, XYList* list) :
+  mFunction(function),
+  mItems(list->mList)
+{
+  for (XYList::iterator it = mItems.begin(); it != mItems.end(); ++it) {
+    XYSymbol* symbol = dynamic_cast<XYSymbol*>(*it);
+    XYEnv::iterator p = symbol ? xy->mP.find(symbol->mValue) : xy->mP.end();
+    mPrimitives.push_back(p != xy->mP.end() ? dynamic_cast<XYPrimitive*>((*p).second) : 0);
+  }
+}
+
+void XYNative::markChildren() {
+  for (XYList::iterator it = mItems.begin(); it != mItems.end(); ++it)
+    (*it)->mark();
+  for (vector<XYPrimitive*>::iterator it = mPrimitives.begin(); it != mPrimitives.end(); ++it)
+    if (*it)
+      (*it)->mark();
+}
+
+bool XYNative::unchanged(XYList* list) {
+  return list->mList.size() == mItems.size() &&
+    equal(mItems.begin(), mItems.end(), list->mList.begin());
+}
+
+void XYNative::run(XY* xy) {
+  XYNativeFrame frame(xy, this);
+  xy->mNatives.push_back(this);
+  try {
+    mFunction(frame);
+  }
+  catch(...) {
+    // Leave the interpreter as it would be had it thrown while
+    // evaluating the item.
+    xy->mNatives.pop_back();
+    frame.resume();
+    throw;
+  }
+  xy->mNatives.pop_back();
+  frame.resume();
+}
+
+// XYNativeFrame
+
+// Calls between native code nest on the C++ stack. Past this depth
+// they are left to the interpreter, which also lets it check limits.
+static size_t const MAX_NATIVE_DEPTH = 256;
+
+XYNativeFrame::XYNativeFrame(XY* xy, XYNative* native) :
+  mXY(xy),
+  mNative(native),
+  mQueueSize(xy->mY.size()),
+  mNext(0)
+{
+}
+
+void XYNativeFrame::push(size_t i) {
+  mNext = i + 1;
+  mNative->mItems[i]->eval1(mXY);
+}
+
+void XYNativeFrame::shuffle(size_t i) {
+  mNext = i + 1;
+  static_cast<XYShuffle*>(mNative->mItems[i])->eval1(mXY);
+}
+
+bool XYNativeFrame::primitive(size_t i) {
+  XYPrimitive* primitive = mNative->mPrimitives[i];
+  if (!primitive)
+    return false;
+
+  mNext = i + 1;
+  primitive->eval1(mXY);
+
+  // Primitives like 'if' continue by queueing a quotation. The
+  // rest of the items must then follow it.
+  return mXY->mY.size() == mQueueSize;
+}
+
+bool XYNativeFrame::call(size_t i) {
+  // The symbol must not be a primitive and the '.' must be
+  if (mNative->mPrimitives[i] || !mNative->mPrimitives[i + 1])
+    return false;
+  if (mXY->mNatives.size() >= MAX_NATIVE_DEPTH)
+    return false;
+
+  // A slot in the primitives object is called in place of the word
+  XYSymbol* symbol = static_cast<XYSymbol*>(mNative->mItems[i]);
+  XYEnv::iterator it = mXY->mEnv.find("primitives");
+  if (it != mXY->mEnv.end() && symbol->lookupSlot((*it).second, 0))
+    return false;
+
+  it = mXY->mEnv.find(symbol->mValue);
+  if (it == mXY->mEnv.end())
+    return false;
+  XYList* list = dynamic_cast<XYList*>((*it).second);
+  if (!list || !list->mNative || !list->mNative->unchanged(list))
+    return false;
+
+  mNext = i + 2;
+  list->mNative->run(mXY);
+  return mXY->mY.size() == mQueueSize;
+}
+
+void XYNativeFrame::resume() {
+  XYSequence::List& items = mNative->mItems;
+  if (mNext >= items.size())
+    return;
+
+  // Anything queued by the items evaluated so far comes first
+  XYQueue& queue = mXY->mY;
+  assert(queue.size() >= mQueueSize);
+  queue.insert(queue.begin() + (queue.size() - mQueueSize), items.begin() + mNext, items.end());
+  mNext = items.size();
+}
+
+void attach_native(XY* xy, string const& name, XYObject* value) {
+  XYCompiledWords::iterator it = xy->mCompiledWords.find(name);
+  if (it == xy->mCompiledWords.end())
+    return;
+
+  XYList* list = dynamic_cast<XYList*>(value);
+  if (!list || list->mNative)
+    return;
+
+  XYCompiledWord const& word = (*it).second;
+  if (list->toString(true) != word.mSource)
+    return;
+
+  // A symbol made by 'to-symbol' can print the same as a number or
+  // shuffle, so check the items have the types that were compiled.
+  XYStack parsed;
+  parse(word.mSource, back_inserter(parsed));
+  XYList* body = parsed.size() == 1 ? dynamic_cast<XYList*>(parsed[0]) : 0;
+  if (!body || body->mList.size() != list->mList.size())
+    return;
+  for (size_t i=0; i < body->mList.size(); ++i) {
+    if (typeid(*body->mList[i]) != typeid(*list->mList[i]))
+      return;
+  }
+
+  list->mNative = new XYNative(xy, word.mFunction, list);
+}
+
+// Primitive Implementations
+
+// + [X^lhs^rhs] Y] -> [X^lhs+rhs Y]
+static void primitive_addition(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* rhs(xy->mX.back());
+  assert(rhs);
+  xy->mX.pop_back();
+
+  XYObject* lhs(xy->mX.back());
+  assert(lhs);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(lhs->add(rhs));
+}
+
+// - [X^lhs^rhs] Y] -> [X^lhs-rhs Y]
+static void primitive_subtraction(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* rhs(xy->mX.back());
+  assert(rhs);
+  xy->mX.pop_back();
+
+  XYObject* lhs(xy->mX.back());
+  assert(lhs);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(lhs->subtract(rhs));
+}
+
+// * [X^lhs^rhs] Y] -> [X^lhs*rhs Y]
+static void primitive_multiplication(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* rhs(xy->mX.back());
+  assert(rhs);
+  xy->mX.pop_back();
+
+  XYObject* lhs(xy->mX.back());
+  assert(lhs);
+  xy->mX.pop_back();
 
   xy->mX.push_back(lhs->multiply(rhs));
 }
@@ -1154,6 +3034,7 @@ static void primitive_set(XY* xy) {
   xy->mX.pop_back();
 
   xy->mEnv[name->mValue] = value;
+  attach_native(xy, name->mValue, value);
 }
 
 // get [X^name Y] [X^value Y]
@@ -1178,9 +3059,8 @@ static void primitive_get(XY* xy) {
     xy_assert(object, XYError::TYPE);
     xy->mX.pop_back();
 
-    set<XYObject*> circular;
     XYObject* context = 0;
-    XYSlot* slot = object->lookup(name->mValue, circular, &context);
+    XYSlot* slot = name->lookupSlot(object, &context);
     xy_assert(slot, XYError::SLOT_NOT_FOUND);
     xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
     xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -1204,16 +3084,43 @@ static void primitive_uncons(XY* xy) {
 
   XYSequence* list = dynamic_cast<XYSequence*>(o);
 
-  if (list && list->size() > 0) {
+  if (list && !list->empty()) {
     xy->mX.push_back(list->head());
     xy->mX.push_back(list->tail());
   }
   else {
     xy->mX.push_back(o);
-    xy->mX.push_back(new XYList());
+    xy->mX.push_back(empty_list());
   }
 }
 
+static void primitive_get_slot_value(XY* xy);
+static void primitive_set_slot_value(XY* xy);
+
+// If 'list' is a data slot getter or setter made by addSlot, call
+// get-slot-value or set-slot-value on the stack directly rather than
+// queueing the list's items. The slot is found through the lookup
+// cache of the name. Returns false if 'list' is not an accessor.
+static bool access_slot(XY* xy, XYList* list) {
+  if (list->mList.size() != 2)
+    return false;
+
+  XYObject* accessor = list->mList[1];
+  if (accessor != get_slot_value_symbol() && accessor != set_slot_value_symbol())
+    return false;
+
+  XYString* name = dynamic_cast<XYString*>(list->mList[0]);
+  if (!name)
+    return false;
+
+  xy->mX.push_back(name);
+  if (accessor == get_slot_value_symbol())
+    primitive_get_slot_value(xy);
+  else
+    primitive_set_slot_value(xy);
+  return true;
+}
+
 // . [X^{O1..On} Y] [X O1^..^On^Y]
 static void primitive_unquote(XY* xy) {
   xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
@@ -1223,7 +3130,16 @@ static void primitive_unquote(XY* xy) {
   XYSequence* list = dynamic_cast<XYSequence*>(o);
 
   if (list) {
-    XYStack temp;
+    XYList* compiled = dynamic_cast<XYList*>(list);
+    if (compiled && access_slot(xy, compiled))
+      return;
+
+    if (compiled && compiled->mNative && compiled->mNative->unchanged(compiled)) {
+      compiled->mNative->run(xy);
+      return;
+    }
+
+    XYSequence::List temp;
     list->pushBackInto(temp);
 
     xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());
@@ -1242,9 +3158,8 @@ static void primitive_unquote(XY* xy) {
 	// If the symbol doesn't exist in the environment, look
 	// it up in the current frame.
 	assert(xy->mFrame);
-	set<XYObject*> circular;
 	XYObject* context = 0;
-	XYSlot* slot = xy->mFrame->lookup(symbol->mValue, circular, &context);
+	XYSlot* slot = symbol->lookupSlot(xy->mFrame, &context);
 	if (slot) {
 	  xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
 	  xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -1278,6 +3193,21 @@ static void primitive_unquote(XY* xy) {
   }
 }
 
+// Returns the compiled form of the pattern, or null if it can't be
+// compiled. Lists cache their compiled form for the next call.
+static XYPattern* compiled_pattern(XYSequence* pattern) {
+  XYList* list = dynamic_cast<XYList*>(pattern);
+  if (list && list->mPattern && list->mPattern->unchanged(list))
+    return list->mPattern;
+
+  XYPattern* compiled(new XYPattern());
+  if (!compiled->compile(pattern))
+    return 0;
+  if (list)
+    list->mPattern = compiled;
+  return compiled;
+}
+
 // ) [X^{pattern} Y] [X^result Y]
 static void primitive_pattern_ss(XY* xy) {
   xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
@@ -1288,6 +3218,12 @@ static void primitive_pattern_ss(XY* xy) {
   xy->mX.pop_back();
   assert(pattern->size() != 0);
 
+  XYPattern* compiled = compiled_pattern(pattern);
+  if (compiled) {
+    compiled->apply(xy, false);
+    return;
+  }
+
   // Populate env with a mapping between the pattern variables to the
   // values on the stack.
   XYEnv env;
@@ -1317,6 +3253,12 @@ static void primitive_pattern_sq(XY* xy) {
   xy->mX.pop_back();
   assert(pattern->size() != 0);
 
+  XYPattern* compiled = compiled_pattern(pattern);
+  if (compiled) {
+    compiled->apply(xy, true);
+    return;
+  }
+
   // Populate env with a mapping between the pattern variables to the
   // values on the stack.
   XYEnv env;
@@ -1348,7 +3290,7 @@ static void primitive_dip(XY* xy) {
   xy->mX.pop_back();
 
   xy->mY.push_front(o);
-  XYStack temp;
+  XYSequence::List temp;
   list->pushBackInto(temp);
   xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());
 }
@@ -1368,7 +3310,7 @@ static void primitive_reverse(XY* xy) {
 
 // \ quote [X^o Y] [X^{o} Y]
 static void primitive_quote(XY* xy) {
-  assert(xy->mY.size() >= 1);
+  xy_assert(xy->mY.size() >= 1, XYError::STACK_UNDERFLOW);
   XYObject* o = xy->mY.front();
   assert(o);
   xy->mY.pop_front();
@@ -1398,16 +3340,17 @@ static void primitive_join(XY*xy) {
   }
   else if(list_lhs) {
     // If rhs is not a list, it is added to the end of the list.
-    if (dynamic_cast<XYList*>(lhs)) {
-      // Optimisation for a list on the lhs. We modify the list.
+    if (dynamic_cast<XYList*>(lhs) && !lhs->mImmutable) {
+      // Optimisation for a list on the lhs. We modify the list. Shared
+      // constants like the empty list fall through to a fresh join.
       dynamic_cast<XYList*>(list_lhs)->mList.push_back(rhs);
+      xy->mX.push_back(list_lhs);
     }
     else {
       XYList* list(new XYList());
       list->mList.push_back(rhs);
       xy->mX.push_back(list_lhs->join(list));
     }
-    xy->mX.push_back(list_lhs);
   }
   else if(list_rhs) {
     // If lhs is not a list, it is added to the front of the list
@@ -1439,8 +3382,9 @@ static void primitive_stack(XY* xy) {
 
   xy->mX.push_back(stack);
   xy->mX.push_back(queue);
-  xy->mY.push_front(new XYSymbol("$$"));
-  XYStack temp;
+  static XYSymbol* unstack = constant(new XYSymbol("$$"));
+  xy->mY.push_front(unstack);
+  XYSequence::List temp;
   list->pushBackInto(temp);
   xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end()); 
 }
@@ -1458,7 +3402,7 @@ static void primitive_stackqueue(XY* xy) {
   xy_assert(stack, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYStack stemp;
+  XYSequence::List stemp;
   stack->pushBackInto(stemp);
 
   XYQueue qtemp;
@@ -1581,6 +3525,78 @@ static void primitive_not(XY* xy) {
   }
 }
 
+static XYObject* nth_path(XY* xy, XYSequence* list, XYSequence* path, size_t start);
+
+// Returns the element of 'list' at 'index', which is either a number
+// or a path. A number past the end of the list returns the size
+// of the list.
+static XYObject* nth_index(XY* xy, XYSequence* list, XYObject* index) {
+  XYNumber* n = dynamic_cast<XYNumber*>(index);
+  if (n) {
+    XYStream* stream = dynamic_cast<XYStream*>(list);
+    if (stream && stream->has(n->as_uint())) {
+      // Avoid computing the size, the stream may be unbounded
+      return stream->at(n->as_uint());
+    }
+
+    if (n->as_uint() >= list->size()) 
+      return new XYInteger(list->size());
+
+    return list->at(n->as_uint());    
+  }
+
+  XYSequence* path = dynamic_cast<XYSequence*>(index);
+  xy_assert(path, XYError::TYPE);
+  return nth_path(xy, list, path, 0);
+}
+
+// Follows the elements of 'path' from 'start' into 'list'. Each
+// element is an index into the result of the previous one. An empty
+// list as an element gathers the rest of the path from every item,
+// and a non-empty list gathers each of its indexes.
+static XYObject* nth_path(XY* xy, XYSequence* list, XYSequence* path, size_t start) {
+  size_t path_len = path->size();
+  if (start >= path_len) {
+    // If the path is empty, return the entire list
+    return list;
+  }
+
+  XYObject* head = path->at(start);
+  XYSequence* headlist = dynamic_cast<XYSequence*>(head);
+  if (headlist && headlist->empty()) {
+    if (start + 1 == path_len)
+      return list;
+
+    size_t len = list->size();
+    XYList* result(new XYList());
+    result->mList.reserve(len);
+    for (size_t i=0; i < len; ++i) {
+      XYSequence* item = dynamic_cast<XYSequence*>(list->at(i));
+      xy_assert(item, XYError::TYPE);
+      result->mList.push_back(nth_path(xy, item, path, start + 1));
+    }
+    return result;
+  }
+  
+  if (headlist) {
+    // Multiple indexes. Any remaining path elements are ignored.
+    size_t len = headlist->size();
+    XYList* result(new XYList());
+    result->mList.reserve(len);
+    for (size_t i=0; i < len; ++i)
+      result->mList.push_back(nth_index(xy, list, headlist->at(i)));
+    return result;
+  }
+
+  XYObject* o = nth_index(xy, list, head);
+  if (start + 1 == path_len)
+    return o;
+
+  XYSequence* next = dynamic_cast<XYSequence*>(o);
+  xy_assert(next, XYError::TYPE);
+  return nth_path(xy, next, path, start + 1);
+}
+
 // @ nth [X^n^{...} Y] [X^o Y] 
 static void primitive_nth(XY* xy) {
   xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
@@ -1593,88 +3609,74 @@ static void primitive_nth(XY* xy) {
   assert(index);
   xy->mX.pop_back();
 
-  XYNumber* n = dynamic_cast<XYNumber*>(index);
-  XYSequence* s = dynamic_cast<XYSequence*>(index);
-  xy_assert(n || s, XYError::TYPE);
+  xy->mX.push_back(nth_index(xy, list, index));
+}
+
+static void set_nth_path(XY* xy, XYSequence* list, XYSequence* path, size_t start, XYObject* v);
 
+// Sets the element of 'list' at 'index', a number or a path, to 'v'.
+static void set_nth_index(XY* xy, XYSequence* list, XYObject* index, XYObject* v) {
+  xy_assert(!dynamic_cast<XYSet*>(list), XYError::IMMUTABLE);
+
+  XYNumber* n = dynamic_cast<XYNumber*>(index);
   if (n) {
-    // Index is a number, do a direct index into the list
-    if (n->as_uint() >= list->size()) 
-      xy->mX.push_back(new XYInteger(list->size()));
-    else
-      xy->mX.push_back(list->at(n->as_uint()));    
-  }
-  else if (s) {
-    // Index is a list. Use this as a path into the list.
-    if (s->size() == 0) {
-      // If the path is empty, return the entire list
-      xy->mX.push_back(list);
-    }    
-    else {
-      XYObject* head = s->head();
-      XYSequence* tail = s->tail();
-
-      // If head is a list, then it's a request to get multiple values
-      XYSequence* headlist = dynamic_cast<XYSequence*>(head);
-      if (headlist && headlist->size() == 0) {
-	if (tail->size() == 0) {
-	  xy->mX.push_back(list);
-	}
-	else {
-	  XYSequence::List code;
-	  XYSequence::List code2;
-	  for (int i=0; i < list->size(); ++i) {
-	    code.push_back(tail);
-	    code.push_back(list->at(i));
-	    code.push_back(new XYSymbol("@"));
-	    code.push_back(new XYSymbol("'"));
-	    code.push_back(new XYSymbol("'"));
-	    code.push_back(new XYSymbol("`"));	  
-	  }	
-	  for (int i=0; i < list->size() - 1; ++i) {
-	    code2.push_back(new XYSymbol(","));
-	  }
-	  xy->mY.insert(xy->mY.begin(), code2.begin(), code2.end());
-	  xy->mY.insert(xy->mY.begin(), code.begin(), code.end());	  
-	}
-      }
-      else if (headlist) {
-	XYSequence::List code;
-	XYSequence::List code2;
-	for (int i=0; i < headlist->size(); ++ i) {
-	  code.push_back(headlist->at(i));
-	  code.push_back(list);
-	  code.push_back(new XYSymbol("@"));
-	  code.push_back(new XYSymbol("'"));
-	  code.push_back(new XYSymbol("'"));
-	  code.push_back(new XYSymbol("`"));
-	}
-	
-	for (int i=0; i < headlist->size()-1; ++i) {
-	  code2.push_back(new XYSymbol(","));
-	}
+    unsigned int i = n->as_uint();
+    xy_assert(!list->mImmutable, XYError::IMMUTABLE);
+    xy_assert(i < list->size(), XYError::RANGE);
+    list->set_at(i, v);
+    return;
+  }
 
-	xy->mY.insert(xy->mY.begin(), code2.begin(), code2.end());
-	xy->mY.insert(xy->mY.begin(), code.begin(), code.end());
-      }
-      else if (tail->size() == 0) {
-	xy->mX.push_back(head);
-	xy->mX.push_back(list);
-	xy->mY.push_front(new XYSymbol("@"));
+  XYSequence* path = dynamic_cast<XYSequence*>(index);
+  xy_assert(path && !path->empty(), XYError::TYPE);
+  set_nth_path(xy, list, path, 0, v);
+}
+
+// Sets every element that '@' would return for the path to 'v'.
+static void set_nth_path(XY* xy, XYSequence* list, XYSequence* path, size_t start, XYObject* v) {
+  size_t path_len = path->size();
+  XYObject* head = path->at(start);
+  XYSequence* headlist = dynamic_cast<XYSequence*>(head);
+  if (headlist && headlist->empty()) {
+    size_t len = list->size();
+    for (size_t i=0; i < len; ++i) {
+      if (start + 1 == path_len) {
+        xy_assert(!dynamic_cast<XYSet*>(list), XYError::IMMUTABLE);
+        xy_assert(!list->mImmutable, XYError::IMMUTABLE);
+        list->set_at(i, v);
       }
       else {
-	xy->mX.push_back(head);
-	xy->mX.push_back(list);
-	xy->mY.push_front(new XYSymbol("@"));
-	xy->mY.push_front(new XYShuffle("ab-ba"));
-	xy->mY.push_front(tail);
-	xy->mY.push_front(new XYSymbol("@"));
+        XYSequence* item = dynamic_cast<XYSequence*>(list->at(i));
+        xy_assert(item, XYError::TYPE);
+        set_nth_path(xy, item, path, start + 1, v);
       }
     }
   }
+  else if (headlist) {
+    size_t len = headlist->size();
+    for (size_t i=0; i < len; ++i)
+      set_nth_index(xy, list, headlist->at(i), v);
+  }
+  else if (start + 1 == path_len) {
+    set_nth_index(xy, list, head, v);
+  }
+  else {
+    XYSequence* next = dynamic_cast<XYSequence*>(nth_index(xy, list, head));
+    xy_assert(next, XYError::TYPE);
+
+    // Copy a shared list before writing into it
+    XYList* shared = dynamic_cast<XYList*>(next);
+    XYNumber* n = dynamic_cast<XYNumber*>(head);
+    if (shared && shared->mImmutable && n && dynamic_cast<XYList*>(list) && !list->mImmutable) {
+      next = new XYList(shared->mList.begin(), shared->mList.end());
+      list->set_at(n->as_uint(), next);
+    }
+    set_nth_path(xy, next, path, start + 1, v);
+  }
 }
 
 // ! set-nth [X^v^n^{...} Y] [X Y] 
+// The index can be a path, as used by '@'.
 static void primitive_set_nth(XY* xy) {
   xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
 
@@ -1682,18 +3684,15 @@ static void primitive_set_nth(XY* xy) {
   xy_assert(list, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYNumber* index(dynamic_cast<XYNumber*>(xy->mX.back()));
-  xy_assert(index, XYError::TYPE);
+  XYObject* index(xy->mX.back());
+  assert(index);
   xy->mX.pop_back();
 
   XYObject* v(xy->mX.back());
   assert(v);
   xy->mX.pop_back();
 
-  unsigned int n = index->as_uint();
-  xy_assert(n < list->size(), XYError::RANGE);
-
-  list->set_at(n, v);
+  set_nth_index(xy, list, index, v);
 }
 
 // print [X^n Y] [X Y] 
@@ -1834,10 +3833,6 @@ static void primitive_stake(XY* xy) {
   }
 }
 
-// Forward declare tokenize function for tokenize primitive
-template <class InputIterator, class OutputIterator>
-void tokenize(InputIterator first, InputIterator last, OutputIterator out);
-
 // tokenize [X^s Y] [X^{tokens} Y] 
 // Given a string, returns a list of cf tokens
 static void primitive_tokenize(XY* xy) {
@@ -1847,8 +3842,9 @@ static void primitive_tokenize(XY* xy) {
   xy_assert(s, XYError::TYPE);
   xy->mX.pop_back();
 
+  char const* first = s->mValue.data();
   vector<string> tokens;
-  tokenize(s->mValue.begin(), s->mValue.end(), back_inserter(tokens));
+  tokenize(first, first + s->mValue.size(), back_inserter(tokens));
 
   XYList* result(new XYList());
   for(vector<string>::iterator it=tokens.begin(); it != tokens.end(); ++it)
@@ -1866,15 +3862,41 @@ static void primitive_parse(XY* xy) {
   xy_assert(tokens, XYError::TYPE);
   xy->mX.pop_back();
 
-  vector<string> strings;
+  // The cache key holds each token preceded by its length
+  string key("t");
   for (int i=0; i < tokens->size(); ++i) {
     XYString* s = dynamic_cast<XYString*>(tokens->at(i));
     xy_assert(s, XYError::TYPE);
-    strings.push_back(s->mValue);
+    size_t size = s->mValue.size();
+    key.append(reinterpret_cast<char const*>(&size), sizeof(size));
+    key.append(s->mValue);
   }
 
+  XYList* result = xy->mParseCache->find(key);
+  if (!result) {
+    vector<string> strings;
+    for (int i=0; i < tokens->size(); ++i)
+      strings.push_back(static_cast<XYString*>(tokens->at(i))->mValue);
+
+    result = new XYList();
+    parse(strings.begin(), strings.end(), back_inserter(result->mList));
+    xy->mParseCache->insert(key, result);
+  }
+  intern(xy, result->mList.begin(), result->mList.end());
+  xy->mX.push_back(result);
+}
+
+// parse-cache-stats [X Y] [X^{hits misses entries bytes} Y]
+// Returns the number of lookups in the parse cache that did and
+// did not find a program, the number of programs cached and the
+// approximate memory they use.
+static void primitive_parse_cache_stats(XY* xy) {
+  XYParseCache* cache = xy->mParseCache;
   XYList* result(new XYList());
-  parse(strings.begin(), strings.end(), back_inserter(result->mList));
+  result->mList.push_back(new XYInteger(cache->mHits));
+  result->mList.push_back(new XYInteger(cache->mMisses));
+  result->mList.push_back(new XYInteger(cache->mEntries.size()));
+  result->mList.push_back(new XYInteger(cache->mBytes));
   xy->mX.push_back(result);
 }
 
@@ -1922,11 +3944,7 @@ static void primitive_enum(XY* xy) {
   xy_assert(n, XYError::TYPE);
   xy->mX.pop_back();
 
-  int value = n->as_uint();
-  XYList* list = new XYList();
-  for(int i=0; i < value; ++i)
-    list->mList.push_back(new XYInteger(i));
-  xy->mX.push_back(list);
+  xy->mX.push_back(new XYRange(0, n->as_uint()));
 }
 
 // clone [X^o Y] -> [X^o Y]
@@ -1980,21 +3998,24 @@ static void primitive_foldl(XY* xy) {
   xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
 			     
-  if (seq->size() == 0) {
+  if (seq->empty()) {
     xy->mX.push_back(seed);
   }
   else {
     XYObject* head(seq->head());
     XYSequence* tail(seq->tail());
   
+    static XYPrimitive* unquote = constant(new XYPrimitive(".", primitive_unquote));
+    static XYPrimitive* foldl = constant(new XYPrimitive("foldl", primitive_foldl));
+
     XYStack temp;
     temp.push_back(tail);
     temp.push_back(seed);
     temp.push_back(head);    
     temp.push_back(quot);
-    temp.push_back(new XYPrimitive(".", primitive_unquote));
+    temp.push_back(unquote);
     temp.push_back(quot);
-    temp.push_back(new XYPrimitive("foldl", primitive_foldl));
+    temp.push_back(foldl);
     
     xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
   }
@@ -2020,26 +4041,156 @@ static void primitive_foldr(XY* xy) {
   xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
 			     
-  if (seq->size() == 0) {
+  if (seq->empty()) {
     xy->mX.push_back(seed);
   }
   else {
     XYObject* head(seq->head());
     XYSequence* tail(seq->tail());
     
+    static XYPrimitive* unquote = constant(new XYPrimitive(".", primitive_unquote));
+    static XYPrimitive* foldr = constant(new XYPrimitive("foldr", primitive_foldr));
+
     XYStack temp;
     temp.push_back(seed);
     temp.push_back(tail);
     temp.push_back(head);    
     temp.push_back(quot);
-    temp.push_back(new XYPrimitive("foldr", primitive_foldr));
+    temp.push_back(foldr);
     temp.push_back(quot);
-    temp.push_back(new XYPrimitive(".", primitive_unquote));
+    temp.push_back(unquote);
     
     xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
   }
 }
 
+// Pops the quotation and sequence for pmap, pfilter and peach and
+// queues the iteration over the sequence.
+static void iterate(XY* xy, XYIteration::Type type) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(quot, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
+  xy->mX.pop_back();
+
+  // Room for a result per element, filled from the back. A stream's
+  // results are moved to a larger list as they're added.
+  XYList* result = 0;
+  size_t start = 0;
+  if (type == XYIteration::SORT) {
+    result = new XYList();
+    result->mList.reserve(seq->size());
+  }
+  else if (type != XYIteration::EACH) {
+    result = new XYList();
+    result->mList.resize(dynamic_cast<XYStream*>(seq) ? 16 : seq->size(), empty_list());
+    start = result->mList.size();
+  }
+
+  if (seq->empty()) {
+    if (result)
+      xy->mX.push_back(new XYList());
+  }
+  else {
+    XYIteration* iteration(new XYIteration(type, seq, quot, result, 0, start));
+    iteration->start(xy);
+  }
+}
+
+// pmap [X^seq^quot Y] -> [X^seq Y]
+// [1 2 3] [1 +] pmap => [2 3 4]
+// Calls the quotation on each element with the element on the
+// top of the stack. The item it leaves there is collected. Below
+// the element are the rest of the sequence and the results so far,
+// most recent first, as the prelude's 'map' left them.
+static void primitive_map(XY* xy) {
+  iterate(xy, XYIteration::MAP);
+}
+
+// pfilter [X^seq^quot Y] -> [X^seq Y]
+// [1 2 3] [2 <] pfilter => [1]
+// Returns the elements for which the quotation returns true. The
+// quotation sees the rest of the sequence, the results so far and
+// the element twice, as the prelude's 'filter' left them.
+static void primitive_filter(XY* xy) {
+  iterate(xy, XYIteration::FILTER);
+}
+
+// peach [X^seq^quot Y] -> [X Y]
+// 0 [1 2 3] [abc-acb [+]`] peach => 6
+// Calls the quotation on each element in turn with the rest of the
+// sequence below it. It continues with the sequence the quotation
+// leaves on the top of the stack, as the prelude's 'each' did.
+static void primitive_each(XY* xy) {
+  iterate(xy, XYIteration::EACH);
+}
+
+// sort-by [X^seq^quot Y] -> [X^seq Y]
+// [3 -1 2] [a-aa *] sort-by => [-1 2 3]
+// Stable sort of the sequence ordered by the key the quotation
+// returns for each element.
+static void primitive_sort_by(XY* xy) {
+  iterate(xy, XYIteration::SORT);
+}
+
+// sort [X^seq Y] -> [X^seq Y]
+// [3 1 2] sort => [1 2 3]
+// Stable sort of the sequence using 'compare'.
+static void primitive_sort(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYString* str(dynamic_cast<XYString*>(seq));
+  if (str) {
+    // Sorting the characters directly avoids boxing each one
+    string sorted(str->mValue);
+    sort(sorted.begin(), sorted.end());
+    xy->mX.push_back(new XYString(sorted));
+  }
+  else
+    xy->mX.push_back(sort_by_keys(seq, seq));
+}
+
+// punfold [X^seed^pred^quot^next Y] -> [X^seq Y]
+// 1 [10 >] [] [1 +] punfold => [1 2 3 4 5 6 7 8 9 10]
+// Returns a lazy sequence. While 'pred' is false for the seed the
+// sequence continues with 'quot' applied to the seed, followed by
+// the sequence for the seed produced by 'next'. Elements are only
+// computed when needed, so the sequence can be unbounded. The
+// quotations see the seed above a copy of the stack at the time
+// of the call. Changes they make to that copy are discarded.
+// The quotations are run by a nested interpreter when an element is
+// needed, so they must not use primitives that wait for asynchronous
+// events such as 'getline' or 'thread-join'.
+// Printing a stream computes its first 100 elements and shows '...'
+// if there may be more.
+static void primitive_unfold(XY* xy) {
+  xy_assert(xy->mX.size() >= 4, XYError::STACK_UNDERFLOW);
+  XYSequence* next(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(next, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(quot, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* pred(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(pred, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYObject* seed(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYList* stack(new XYList(xy->mX.begin(), xy->mX.end()));
+  XYStreamChunk* chunk(new XYStreamChunk(xy, seed, pred, quot, next, stack));
+  xy->mX.push_back(new XYStream(chunk, 0));
+}
+
 // if [X^bool^then^else Y] -> [X Y]
 // 2 1 = [ ... ] [ ... ] if
 static void primitive_if(XY* xy) {
@@ -2053,19 +4204,16 @@ static void primitive_if(XY* xy) {
   xy->mX.pop_back();
 
   XYObject* o(xy->mX.back());
-  XYNumber* num(dynamic_cast<XYNumber*>(o));
-  XYSequence* seq(dynamic_cast<XYSequence*>(o));
-  xy_assert(o || num || seq, XYError::TYPE);
+  xy_assert(o, XYError::TYPE);
   xy->mX.pop_back();
 
-  if (num && num->is_zero() ||
-      seq && seq->size() == 0) {
-    XYStack temp;
+  if (is_false(o)) {
+    XYSequence::List temp;
     else_quot->pushBackInto(temp);
     xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
   }
   else {
-    XYStack temp;
+    XYSequence::List temp;
     then_quot->pushBackInto(temp);
     xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
   } 
@@ -2081,6 +4229,12 @@ static void primitive_find(XY* xy) {
   xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
 
+  XYSet* set(dynamic_cast<XYSet*>(seq));
+  if (set) {
+    xy->mX.push_back(new XYInteger(static_cast<long>(set->find(elt))));
+    return;
+  }
+
   int i=0;
   for (i=0; i < seq->size(); ++i) {
     if(seq->at(i)->compare(elt) == 0)
@@ -2090,9 +4244,197 @@ static void primitive_find(XY* xy) {
   xy->mX.push_back(new XYInteger(i));
 }
 
+// Returns the sequence as a set, building one if it is
+// not already a set.
+static XYSet* as_set(XYSequence* seq) {
+  XYSet* set(dynamic_cast<XYSet*>(seq));
+  if (set)
+    return set;
+
+  set = new XYSet();
+  size_t len = seq->size();
+  for (size_t i=0; i < len; ++i)
+    set->insert(seq->at(i));
+  return set;
+}
+
+// Pops the two sequences for the set operations. 'lhs' is
+// the deeper of the two on the stack.
+static void pop_set_operands(XY* xy, XYSequence*& lhs, XYSequence*& rhs) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  rhs = dynamic_cast<XYSequence*>(xy->mX.back());
+  xy_assert(rhs, XYError::TYPE);
+  xy->mX.pop_back();
+
+  lhs = dynamic_cast<XYSequence*>(xy->mX.back());
+  xy_assert(lhs, XYError::TYPE);
+  xy->mX.pop_back();
+}
+
+// to-set [X^seq Y] -> [X^set Y]
+// [1 2 1 3] to-set => [1 2 3]
+// Returns a set of the elements of the sequence.
+static void primitive_to_set(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(as_set(seq));
+}
+
+// set-union [X^seq^seq Y] -> [X^set Y]
+// [1 2] [2 3] set-union => [1 2 3]
+static void primitive_set_union(XY* xy) {
+  XYSequence* lhs;
+  XYSequence* rhs;
+  pop_set_operands(xy, lhs, rhs);
+
+  XYSet* result(new XYSet());
+  size_t len = lhs->size();
+  for (size_t i=0; i < len; ++i)
+    result->insert(lhs->at(i));
+  len = rhs->size();
+  for (size_t i=0; i < len; ++i)
+    result->insert(rhs->at(i));
+
+  xy->mX.push_back(result);
+}
+
+// set-intersection [X^seq^seq Y] -> [X^set Y]
+// [1 2 3] [3 2 4] set-intersection => [2 3]
+static void primitive_set_intersection(XY* xy) {
+  XYSequence* lhs;
+  XYSequence* rhs;
+  pop_set_operands(xy, lhs, rhs);
+
+  XYSet* other(as_set(rhs));
+  XYSet* result(new XYSet());
+  size_t len = lhs->size();
+  for (size_t i=0; i < len; ++i) {
+    XYObject* o(lhs->at(i));
+    if (other->find(o) != other->size())
+      result->insert(o);
+  }
+
+  xy->mX.push_back(result);
+}
+
+// set-difference [X^seq^seq Y] -> [X^set Y]
+// [1 2 3] [2] set-difference => [1 3]
+static void primitive_set_difference(XY* xy) {
+  XYSequence* lhs;
+  XYSequence* rhs;
+  pop_set_operands(xy, lhs, rhs);
+
+  XYSet* other(as_set(rhs));
+  XYSet* result(new XYSet());
+  size_t len = lhs->size();
+  for (size_t i=0; i < len; ++i) {
+    XYObject* o(lhs->at(i));
+    if (other->find(o) == other->size())
+      result->insert(o);
+  }
+
+  xy->mX.push_back(result);
+}
+
+// dict [X Y] -> [X^dict Y]
+// Returns a new, empty, dictionary
+static void primitive_dict(XY* xy) {
+  xy->mX.push_back(new XYDictionary());
+}
+
+// dict-get [X^dict^key Y] -> [X^value Y]
+// Returns the value stored for the key, or an empty
+// list if there is none.
+static void primitive_dict_get(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* key(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYObject* value = dict->get(key);
+  xy->mX.push_back(value ? value : empty_list());
+}
+
+// dict-put [X^dict^value^key Y] -> [X^dict Y]
+// Stores the value for the key, replacing any existing value
+static void primitive_dict_put(XY* xy) {
+  xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
+  XYObject* key(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYObject* value(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+
+  dict->put(key, value);
+}
+
+// dict-remove [X^dict^key Y] -> [X^dict Y]
+// Removes the key and its value if it exists
+static void primitive_dict_remove(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* key(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+
+  dict->remove(key);
+}
+
+// dict-has? [X^dict^key Y] -> [X^bool Y]
+// Returns true if the dictionary has a value for the key
+static void primitive_dict_has(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* key(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(new XYInteger(dict->get(key) ? 1 : 0));
+}
+
+// dict-keys [X^dict Y] -> [X^{keys} Y]
+// Returns a list of the keys in the dictionary
+static void primitive_dict_keys(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYList* keys(new XYList());
+  keys->mList.reserve(dict->size());
+  dict->keys(keys->mList);
+  xy->mX.push_back(keys);
+}
+
+// dict-size [X^dict Y] -> [X^n Y]
+// Returns the number of keys in the dictionary
+static void primitive_dict_size(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYDictionary* dict(dynamic_cast<XYDictionary*>(xy->mX.back()));
+  xy_assert(dict, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(new XYInteger(dict->size()));
+}
+
 // gc gc [X Y] -> [X Y]
 static void primitive_gc(XY* xy) {
-  GarbageCollector::GC.collect();
+  // Primitives calling 'apply' hold objects in C++ locals that
+  // are not roots, so don't collect inside a nested evaluation.
+  if (xy->mSaved.size() == 0)
+    GarbageCollector::GC.collect();
 }
 
 // copy copy [X^object Y] -> [X^object Y]
@@ -2119,14 +4461,7 @@ static void primitive_has_slot(XY* xy) {
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
-  string name3;
-  if (name)
-    name3 = name->mValue;
-  if (name2)
-    name3 = name2->mValue;
-
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name3, circular, 0);
+  XYSlot* slot = name ? name->lookupSlot(object, 0) : name2->lookupSlot(object, 0);
   xy->mX.push_back(new XYInteger(slot ? 1 : 0));
 }
 
@@ -2145,6 +4480,7 @@ static void primitive_add_slot(XY* xy) {
 
   XYObject* object(xy->mX.back());
   xy_assert(object, XYError::TYPE);
+  xy_assert(!object->mImmutable, XYError::IMMUTABLE);
   xy->mX.pop_back();
 
   object->addSlot(name->mValue, value, false);
@@ -2166,6 +4502,7 @@ static void primitive_add_ro_slot(XY* xy) {
 
   XYObject* object(xy->mX.back());
   xy_assert(object, XYError::TYPE);
+  xy_assert(!object->mImmutable, XYError::IMMUTABLE);
   xy->mX.pop_back();
 
   object->addSlot(name->mValue, value, true);
@@ -2194,6 +4531,7 @@ static void primitive_add_method(XY* xy) {
 
   XYObject* object(xy->mX.back());
   xy_assert(object, XYError::TYPE);
+  xy_assert(!object->mImmutable, XYError::IMMUTABLE);
   xy->mX.pop_back();
 
   XYList* list = dynamic_cast<XYList*>(method);
@@ -2222,8 +4560,7 @@ static void primitive_get_slot_value(XY* xy) {
   XYObject* value = object->getSlot(name->mValue)->mValue;
   xy_assert(value, XYError::INVALID_SLOT_TYPE);
 #endif
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name->mValue, circular, 0);  
+  XYSlot* slot = name->lookupSlot(object, 0);
   xy_assert(slot, XYError::INVALID_SLOT_TYPE);
   xy_assert(slot->mValue, XYError::INVALID_SLOT_TYPE);
   xy->mX.push_back(slot->mValue);
@@ -2246,18 +4583,43 @@ static void primitive_set_slot_value(XY* xy) {
   xy_assert(value, XYError::TYPE);
   xy->mX.pop_back();
 
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name->mValue, circular, 0);  
+  XYObject* context = 0;
+  XYSlot* slot = name->lookupSlot(object, &context);
   xy_assert(slot, XYError::INVALID_SLOT_TYPE);
   xy_assert(slot->mValue, XYError::INVALID_SLOT_TYPE);
-  slot->mValue = value;
+  context->setSlotValue(slot - context->slotAt(0), value);
   
   xy->mX.push_back(object);
 }
 
-// call-method call-method [X^object^method Y] -> [X Y]
-// Calls the method by copying it, installing the copy as
-// the current frame, and running the code.
+// Returns the frame for a call of 'method' on 'object': a copy of
+// the method object with a 'self' parent slot. Its slots are
+// allocated once at their final size. The 'self' getter is shared
+// by all frames.
+static XYObject* make_frame(XYObject* method, XYObject* object) {
+  static XYList* getter = 0;
+  if (!getter) {
+    getter = constant(new XYList());
+    getter->mList.push_back(constant(new XYString("self")));
+    getter->mList.push_back(get_slot_value_symbol());
+  }
+
+  assert(method->mShape->find("self") < 0);
+
+  XYObject* frame = new XYObject();
+  frame->mShape = method->mShape->add("self", true);
+  frame->mSlots = boost::make_shared<XYObject::Slots>();
+  frame->mSlots->reserve(method->mShape->mNames.size() + 1);
+  if (method->mSlots)
+    *frame->mSlots = *method->mSlots;
+  frame->mSlots->push_back(XYSlot(getter, object));
+  return frame;
+}
+
+// call-method call-method [X^...^object^method Y] -> [X Y]
+// Calls the method by copying it, setting the argument slots
+// of the copy from the stack, installing it as the current frame,
+// and running the code.
 static void primitive_call_method(XY* xy) {
   xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
   
@@ -2269,14 +4631,36 @@ static void primitive_call_method(XY* xy) {
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
   
-  XYObject* frame = method->copy();
-  frame->addSlot("self*", object);
+  static XYSymbol* set_frame = constant(new XYSymbol("set-frame"));
+  static XYSymbol* unquote = constant(new XYSymbol("."));
 
-  XYSequence* code = dynamic_cast<XYSequence*>(method->getSlot("code")->mValue);
+  XYSlot* code_slot = method->getSlot("code");
+  xy_assert(code_slot, XYError::SLOT_NOT_FOUND);
+  XYSequence* code = dynamic_cast<XYSequence*>(code_slot->mValue);
   xy_assert(code, XYError::TYPE);
-  XYSequence* args = dynamic_cast<XYSequence*>(method->getSlot("args")->mValue);
+  XYSlot* args_slot = method->getSlot("args");
+  xy_assert(args_slot, XYError::SLOT_NOT_FOUND);
+  XYSequence* args = dynamic_cast<XYSequence*>(args_slot->mValue);
   xy_assert(args, XYError::TYPE);
 
+  XYObject* frame = make_frame(method, object);
+
+  // Populate the frame's argument slots with items on the stack. This
+  // does the work of set-method-args directly on the new frame.
+  int n = args->size();
+  xy_assert(xy->mX.size() >= static_cast<size_t>(n), XYError::STACK_UNDERFLOW);
+  for (int i=0; i < n; ++i) {
+    XYSymbol* name = dynamic_cast<XYSymbol*>(args->at(n-i-1));
+    xy_assert(name, XYError::TYPE);
+    int index = frame->mShape->find(name->mValue);
+    xy_assert(index >= 0, XYError::SLOT_NOT_FOUND);
+
+    XYObject* arg(xy->mX.back());
+    xy_assert(arg, XYError::TYPE);
+    xy->mX.pop_back();
+    frame->setSlotValue(index, arg);
+  }
+
 #if 0
 // DEBUG
 //xy->print();
@@ -2310,11 +4694,11 @@ cout << "call-method " << xy->mX.size() << " " << xy->mY.size();
 
   // Restore the original frame
   XYObject* oldFrame = xy->mFrame;
-  xy->mY.push_front(new XYSymbol("set-frame"));
+  xy->mY.push_front(set_frame);
   xy->mY.push_front(oldFrame);
 
   // Run the method body
-  xy->mY.push_front(new XYSymbol("."));
+  xy->mY.push_front(unquote);
 
   // Find the list containing the code to run for the method.
   // By doing the lookup at runtime we'll always get the latest
@@ -2326,22 +4710,9 @@ cout << "call-method " << xy->mX.size() << " " << xy->mY.size();
   xy->mY.push_front(new XYSymbol("code"));
   xy->mY.push_front(frame);
 #endif
-  // Populate the frame's argument slots with items on the stack
-  xy->mY.push_front(new XYSymbol("set-method-args"));
-  xy->mY.push_front(frame);
-
-  // Get the list of arguments that this method takes.
-  xy->mY.push_front(args);
-#if 0
-  xy->mY.push_front(new XYSymbol("."));
-  xy->mY.push_front(new XYSymbol("lookup"));
-  xy->mY.push_front(new XYSymbol("args"));
-  xy->mY.push_front(frame);
-#endif
 
   // Set the current frame to be the one for this method call
-  xy->mY.push_front(new XYSymbol("set-frame"));
-  xy->mY.push_front(frame);
+  xy->mFrame = frame;
 }
 
 // set-method-args set-method-args [X^...^args^method Y] -> [X Y]
@@ -2360,6 +4731,11 @@ static void primitive_set_method_args(XY* xy) {
   xy->mX.pop_back();
 
   xy_assert(xy->mX.size() >= args->size(), XYError::STACK_UNDERFLOW);
+
+  static XYShuffle* drop = constant(new XYShuffle("a-"));
+  static XYSymbol* unquote = constant(new XYSymbol("."));
+  static XYSymbol* lookup = constant(new XYSymbol("lookup"));
+
   int n = args->size();
   for (int i=0; i < n; ++i) {
     XYSymbol* name = dynamic_cast<XYSymbol*>(args->at(n-i-1));
@@ -2369,9 +4745,9 @@ static void primitive_set_method_args(XY* xy) {
     xy_assert(arg, XYError::TYPE);
     xy->mX.pop_back();
 
-    xy->mY.push_front(new XYShuffle("a-"));
-    xy->mY.push_front(new XYSymbol("."));
-    xy->mY.push_front(new XYSymbol("lookup"));
+    xy->mY.push_front(drop);
+    xy->mY.push_front(unquote);
+    xy->mY.push_front(lookup);
     xy->mY.push_front(new XYSymbol(name->mValue + ":"));
     xy->mY.push_front(method);    
     xy->mY.push_front(arg);    
@@ -2392,9 +4768,8 @@ static void primitive_lookup(XY* xy) {
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
-  set<XYObject*> circular;
   XYObject* context = 0;
-  XYSlot* slot = object->lookup(name->mValue, circular, &context);
+  XYSlot* slot = name->lookupSlot(object, &context);
   xy_assert(slot, XYError::SLOT_NOT_FOUND);
   xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
   xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -2502,6 +4877,10 @@ string XYError::message() {
     str << "Type error";
     break;
 
+  case IMMUTABLE:
+    str << "Attempt to modify an immutable object";
+    break;
+
   default:
     return "Unknown error";
   }
@@ -2522,7 +4901,9 @@ XY::XY(boost::asio::io_service& service) :
   mInputStream(service, ::dup(STDIN_FILENO)),
   mOutputStream(service, ::dup(STDOUT_FILENO)),
   mFrame(0),
-  mRepl(true) {
+  mRepl(true),
+  mParseCache(new XYParseCache(1024 * 1024)),
+  mInterner(0) {
   mP["+"]   = new XYPrimitive("+", primitive_addition);
   mP["-"]   = new XYPrimitive("-", primitive_subtraction);
   mP["*"]   = new XYPrimitive("*", primitive_multiplication);
@@ -2555,6 +4936,7 @@ XY::XY(boost::asio::io_service& service) :
   mP["count"] = new XYPrimitive("count", primitive_count);
   mP["tokenize"] = new XYPrimitive("tokenize", primitive_tokenize);
   mP["parse"] = new XYPrimitive("parse", primitive_parse);
+  mP["parse-cache-stats"] = new XYPrimitive("parse-cache-stats", primitive_parse_cache_stats);
   mP["getline"] = new XYPrimitive("getline", primitive_getline);
   mP["millis"] = new XYPrimitive("millis", primitive_millis);
   mP["enum"]   = new XYPrimitive("+", primitive_enum);
@@ -2566,9 +4948,26 @@ XY::XY(boost::asio::io_service& service) :
   mP["stake"] = new XYPrimitive("stake", primitive_stake);
   mP["foldl"] = new XYPrimitive("foldl", primitive_foldl);
   mP["foldr"] = new XYPrimitive("foldr", primitive_foldr);
+  mP["pmap"] = new XYPrimitive("pmap", primitive_map);
+  mP["pfilter"] = new XYPrimitive("pfilter", primitive_filter);
+  mP["peach"] = new XYPrimitive("peach", primitive_each);
+  mP["sort"] = new XYPrimitive("sort", primitive_sort);
+  mP["sort-by"] = new XYPrimitive("sort-by", primitive_sort_by);
+  mP["punfold"] = new XYPrimitive("punfold", primitive_unfold);
   mP["if"] = new XYPrimitive("if", primitive_if);
   mP["?"] = new XYPrimitive("?", primitive_find);
   mP["gc"] = new XYPrimitive("gc", primitive_gc);
+  mP["dict"] = new XYPrimitive("dict", primitive_dict);
+  mP["dict-get"] = new XYPrimitive("dict-get", primitive_dict_get);
+  mP["dict-put"] = new XYPrimitive("dict-put", primitive_dict_put);
+  mP["dict-remove"] = new XYPrimitive("dict-remove", primitive_dict_remove);
+  mP["dict-has?"] = new XYPrimitive("dict-has?", primitive_dict_has);
+  mP["dict-keys"] = new XYPrimitive("dict-keys", primitive_dict_keys);
+  mP["dict-size"] = new XYPrimitive("dict-size", primitive_dict_size);
+  mP["to-set"] = new XYPrimitive("to-set", primitive_to_set);
+  mP["set-union"] = new XYPrimitive("set-union", primitive_set_union);
+  mP["set-intersection"] = new XYPrimitive("set-intersection", primitive_set_intersection);
+  mP["set-difference"] = new XYPrimitive("set-difference", primitive_set_difference);
 
   // Object system test primitives. These will change
   // when the system settles down.
@@ -2626,8 +5025,21 @@ void XY::markChildren() {
        ++it) {
     (*it)->mark();
   }
+  for (deque<pair<XYStack, XYQueue> >::iterator it = mSaved.begin();
+       it != mSaved.end();
+       ++it) {
+    for (XYStack::iterator sit = (*it).first.begin(); sit != (*it).first.end(); ++sit)
+      (*sit)->mark();
+    for (XYQueue::iterator qit = (*it).second.begin(); qit != (*it).second.end(); ++qit)
+      (*qit)->mark();
+  }
   if (mFrame)
     mFrame->mark();
+  mParseCache->mark();
+  if (mInterner)
+    mInterner->mark();
+  for (vector<XYNative*>::iterator it = mNatives.begin(); it != mNatives.end(); ++it)
+    (*it)->mark();
 }
 
 void XY::stdioHandler(boost::system::error_code const& err) {
@@ -2635,7 +5047,16 @@ void XY::stdioHandler(boost::system::error_code const& err) {
     istream stream(&mInputBuffer);
     string input;
     std::getline(stream, input);
-    parse(input, back_inserter(mY));
+
+    string key("s" + input);
+    XYList* program = mParseCache->find(key);
+    if (!program) {
+      program = new XYList();
+      parse(input, back_inserter(program->mList));
+      mParseCache->insert(key, program);
+    }
+    intern(this, program->mList.begin(), program->mList.end());
+    mY.insert(mY.end(), program->mList.begin(), program->mList.end());
 
     // Start the limit counting here for stdio/repl based code
     for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
@@ -2781,6 +5202,42 @@ void XY::eval() {
   }
 }
 
+XYObject* XY::apply(XYObject* value, XYSequence* quotation, XYList* stack) {
+  XY* xy = this;
+  mSaved.push_back(make_pair(XYStack(), XYQueue()));
+  mX.swap(mSaved.back().first);
+  mY.swap(mSaved.back().second);
+
+  XYObject* result = 0;
+  try {
+    if (stack)
+      mX.assign(stack->mList.begin(), stack->mList.end());
+    mX.push_back(value);
+    XYSequence::List temp;
+    quotation->pushBackInto(temp);
+    mY.insert(mY.begin(), temp.begin(), temp.end());
+
+    while (mY.size() > 0) {
+      eval1();
+      checkLimits();
+    }
+
+    xy_assert(mX.size() >= 1, XYError::STACK_UNDERFLOW);
+    result = mX.back();
+  }
+  catch(...) {
+    mX.swap(mSaved.back().first);
+    mY.swap(mSaved.back().second);
+    mSaved.pop_back();
+    throw;
+  }
+
+  mX.swap(mSaved.back().first);
+  mY.swap(mSaved.back().second);
+  mSaved.pop_back();
+  return result;
+}
+
 template <class OutputIterator>
 void XY::match(OutputIterator out, 
                XYObject* object,
@@ -2801,7 +5258,7 @@ void XY::match(OutputIterator out,
     while(pi < pattern_list->size()) {
       XYSymbol* s = dynamic_cast<XYSymbol*>(pattern_list->at(pi));
       if (s) {
-        *out++ = make_pair(s->mValue, new XYList());
+        *out++ = make_pair(s->mValue, empty_list());
       }
       ++pi;
     }
@@ -2864,112 +5321,351 @@ void XY::replacePattern(XYEnv const& env, XYObject* object, OutputIterator out)
     *out++ = object;
 }
 
-enum XYState {
-  XYSTATE_INIT,
-  XYSTATE_STRING_START,
-  XYSTATE_STRING_MIDDLE,
-  XYSTATE_STRING_END,
-  XYSTATE_NUMBER_START,
-  XYSTATE_NUMBER_REST,
-  XYSTATE_SYMBOL_START,
-  XYSTATE_SYMBOL_REST,
-  XYSTATE_LIST_START
-};
+// Returns true if 'c' is whitespace that separates tokens
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Returns true if 'c' is always a token on its own
+static bool is_special(char c) {
+  switch (c) {
+  case '\\': case '[': case ']': case '{': case '}': case '(': case ')':
+  case ';': case '!': case '.': case ',': case '`': case '\'': case '|':
+  case '@': case '+': case '*':
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Skip an optional '-' and a run of digits. Returns 'first' if
+// there are no digits.
+static char const* scan_integer(char const* first, char const* last) {
+  char const* p = first;
+  if (p != last && *p == '-')
+    ++p;
+  char const* digits = p;
+  while (p != last && is_digit(*p))
+    ++p;
+  return p == digits ? first : p;
+}
+
+// Skip a float of the form -1.23 or 1. Returns 'first' if there
+// is no float.
+static char const* scan_float(char const* first, char const* last) {
+  char const* p = scan_integer(first, last);
+  if (p == first || p == last || *p != '.')
+    return first;
+  ++p;
+  while (p != last && is_digit(*p))
+    ++p;
+  return p;
+}
+
+// Skip a string, including the surrounding quotes. Returns
+// 'first' if there is no closing quote.
+static char const* scan_string(char const* first, char const* last) {
+  if (first == last || *first != '"')
+    return first;
+  char const* p = first + 1;
+  while (p != last && *p != '"') {
+    if (*p == '\\') {
+      if (p + 1 == last)
+        return first;
+      ++p;
+    }
+    ++p;
+  }
+  return p == last ? first : p + 1;
+}
+
+// Skip a comment of the form ** ... **. Returns 'first' if there
+// is no comment.
+static char const* scan_comment(char const* first, char const* last) {
+  if (last - first < 4 || first[0] != '*' || first[1] != '*')
+    return first;
+  for (char const* p = first + 2; p + 1 < last; ++p)
+    if (p[0] == '*' && p[1] == '*')
+      return p + 2;
+  return first;
+}
+
+// Return the type of a token made up of non-special characters,
+// optionally followed by '+' and '*' characters.
+static XYToken::Type classify_word(char const* first, char const* last) {
+  if (scan_integer(first, last) == last)
+    return XYToken::INTEGER;
+  if (is_shuffle_pattern(first, last))
+    return XYToken::SHUFFLE;
+  return XYToken::SYMBOL;
+}
+
+XYToken next_token(char const* first, char const* last) {
+  while (first != last && is_space(*first))
+    ++first;
+
+  XYToken token;
+  token.mBegin = first;
+  token.mEnd = first;
+  if (first == last) {
+    token.mType = XYToken::END;
+    return token;
+  }
+
+  // Alternatives are tried in order, the first that matches at
+  // this position decides the extent of the token.
+  char const* end;
+  if ((end = scan_comment(first, last)) != first) {
+    token.mType = XYToken::COMMENT;
+  }
+  else if ((end = scan_string(first, last)) != first) {
+    token.mType = XYToken::STRING;
+  }
+  else if ((end = scan_float(first, last)) != first) {
+    token.mType = XYToken::FLOAT;
+  }
+  else if (is_special(*first)) {
+    end = first + 1;
+    token.mType = *first == '[' ? XYToken::OPEN :
+                  *first == ']' ? XYToken::CLOSE :
+                  XYToken::SYMBOL;
+  }
+  else {
+    end = first;
+    while (end != last && !is_space(*end) && !is_special(*end))
+      ++end;
+    while (end != last && (*end == '+' || *end == '*'))
+      ++end;
+    token.mType = classify_word(first, end);
+  }
+
+  token.mEnd = end;
+  return token;
+}
+
+XYToken::Type classify_token(char const* first, char const* last) {
+  if (last - first >= 4 && first[0] == '*' && first[1] == '*' &&
+      last[-2] == '*' && last[-1] == '*')
+    return XYToken::COMMENT;
+  if (scan_string(first, last) == last && first != last)
+    return XYToken::STRING;
+  if (scan_float(first, last) == last && first != last)
+    return XYToken::FLOAT;
+  if (scan_integer(first, last) == last && first != last)
+    return XYToken::INTEGER;
+  if (last - first == 1 && *first == '[')
+    return XYToken::OPEN;
+  if (last - first == 1 && *first == ']')
+    return XYToken::CLOSE;
+  if (is_shuffle_pattern(first, last))
+    return XYToken::SHUFFLE;
+  return XYToken::SYMBOL;
+}
+
+XYObject* token_object(XYToken const& token) {
+  string text(token.mBegin, token.mEnd);
+  switch (token.mType) {
+  case XYToken::STRING:
+    text = text.substr(1, text.size() - 2);
+    if (text.find('\\') != string::npos)
+      text = unescape(text);
+    return new XYString(text);
+
+  case XYToken::FLOAT:
+    return new XYFloat(text);
+
+  case XYToken::INTEGER:
+    return new XYInteger(text);
+
+  case XYToken::SHUFFLE:
+    return new XYShuffle(text);
+
+  case XYToken::SYMBOL:
+    return new XYSymbol(text);
+
+  default:
+    assert(1 == 0);
+    return 0;
+  }
+}
 
 // Returns true if the string is a shuffle pattern
-bool is_shuffle_pattern(string s) {
+bool is_shuffle_pattern(char const* first, char const* last) {
   // A string is a shuffle pattern if it is of the form:
   //   abcd-dbca
   // No letters may be duplicated on the lhs.
   // The rhs must not contain letters that are not in the lhs.
   // The lhs may be empty but the rhs may not be.
-  vector<string> result;
-  split(result, s, is_any_of("-"));
-  if (result.size() != 2)
+  char const* dash = find(first, last, '-');
+  if (dash == last || find(dash + 1, last, '-') != last)
     return false;
 
-  string before = trim_copy(result[0]);
-  string after = trim_copy(result[1]);
-
-  if(before.size() == 0 && after.size() == 0)
+  char const* before = first;
+  char const* before_end = dash;
+  char const* after = dash + 1;
+  char const* after_end = last;
+  while (before != before_end && is_space(*before))
+    ++before;
+  while (before_end != before && is_space(before_end[-1]))
+    --before_end;
+  while (after != after_end && is_space(*after))
+    ++after;
+  while (after_end != after && is_space(after_end[-1]))
+    --after_end;
+
+  if (before == before_end && after == after_end)
     return false;
- 
-  sort(before.begin(), before.end());
-  string::iterator bsend = before.end();
-  string::iterator bnend = unique(before.begin(), before.end());
-  if(bsend != bnend)
-    return false; // Duplicates on the lhs of the pattern are invalid
-  sort(after.begin(), after.end());
-  string::iterator anend = unique(after.begin(), after.end());
-  vector<char> diff;
-  set_difference(after.begin(), anend, before.begin(), bnend, back_inserter(diff));
-  return diff.size() == 0;
-}
-
-// Return regex for tokenizing integers
-boost::xpressive::sregex re_integer() {
-  using namespace boost::xpressive;
-  using boost::xpressive::optional;
-  return optional('-') >> +_d;
-}
 
-// Return regex for tokenizing floats
-boost::xpressive::sregex re_float() {
-  using namespace boost::xpressive;
-  using boost::xpressive::optional;
-  return optional('-') >> +_d >> '.' >> *_d;
+  bool seen[256] = { false };
+  for (; before != before_end; ++before) {
+    unsigned char c = *before;
+    if (seen[c])
+      return false; // Duplicates on the lhs of the pattern are invalid
+    seen[c] = true;
+  }
+  for (; after != after_end; ++after)
+    if (!seen[static_cast<unsigned char>(*after)])
+      return false;
+  return true;
 }
 
-// Return regex for tokenizing numbers
-boost::xpressive::sregex re_number() {
-  using namespace boost::xpressive;
-  return re_float() | re_integer();
+bool is_shuffle_pattern(string const& s) {
+  return is_shuffle_pattern(s.data(), s.data() + s.size());
 }
 
-// Return regex for tokenizing specials
-boost::xpressive::sregex re_special() {
-  using namespace boost::xpressive;
-  using boost::xpressive::set;
-  return (set= '\\' , '[' , ']' , '{' , '}' , '(' , ')' , ';' , '!' , '.' , ',' , '`' , '\'' , '|', '@', '+', '*');
-}
+// Read the next line of code from a source file into 'line'. For
+// a literate file this is the next Bird style line, with the leading
+// '>' removed, or the next line between \begin{code} and \end{code}.
+// 'code' is true while inside a \begin{code} block.
+static bool next_source_line(istream& file, bool literate, bool& code, string& line) {
+  while (getline(file, line)) {
+    if (!literate)
+      return true;
 
-// Return regex for non-specials
-boost::xpressive::sregex re_non_special() {
-  using namespace boost::xpressive;
-  using boost::xpressive::set;
-  return ~(set[(set= '\\','[',']','{','}','(',')',';','!','.',',','`','\'','|','@','+','*') | _s]);
+    if (code) {
+      if (line == "\\end{code}")
+        code = false;
+      else
+        return true;
+    }
+    else if (line.size() > 0 && line[0] == '>') {
+      line.erase(0, 1);
+      return true;
+    }
+    else if (line == "\\begin{code}") {
+      code = true;
+    }
+  }
+  return false;
 }
 
-// Return regex for allowed end of symbols
-boost::xpressive::sregex re_symbol_end() {
-  using namespace boost::xpressive;
-  using boost::xpressive::set;
-  return (set= '+', '*');
-}
+// Returns true if more source might extend the token. This is the
+// case for the opening quote of a string or comment that has not
+// been closed yet.
+static bool is_unterminated(XYToken const& token, char const* last) {
+  if (token.mType == XYToken::STRING || token.mType == XYToken::COMMENT)
+    return false;
+  if (*token.mBegin == '"')
+    return true;
+  return token.mType == XYToken::SYMBOL &&
+         token.mEnd - token.mBegin == 1 &&
+         *token.mBegin == '*' &&
+         token.mEnd != last &&
+         *token.mEnd == '*';
+}
+
+// Returns true if the token is a primitive that takes what follows
+// it from the queue, so a statement ending with it continues.
+static bool is_queue_reader(XYToken const& token) {
+  if (token.mType != XYToken::SYMBOL)
+    return false;
+  string name(token.mBegin, token.mEnd);
+  return name == "'" || name == "$" || name == "$$";
+}
+
+void load_file(XY* xy, char const* filename) {
+  cout << "Loading " << filename << endl;
+
+  char const* ext = strrchr(filename, '.');
+  bool literate = ext && strcmp(ext, ".lcf") == 0;
+  ifstream file(filename);
+
+  // The statement being read. 'scanned' is the length of the
+  // statement that has been tokenized and 'depth' the number of
+  // lists that are open at that point. 'reader' is true if the
+  // last token scanned reads from the queue.
+  string statement;
+  size_t scanned = 0;
+  int depth = 0;
+  bool reader = false;
+
+  bool code = false;
+  string line;
+  while (next_source_line(file, literate, code, line)) {
+    statement += line;
+    statement += '\n';
+
+    char const* first = statement.data();
+    char const* last = first + statement.size();
+    bool complete = true;
+    XYToken token = next_token(first + scanned, last);
+    while (token.mType != XYToken::END && depth >= 0) {
+      if (is_unterminated(token, last)) {
+        complete = false;
+        break;
+      }
 
-// Return regex for symbols
-boost::xpressive::sregex re_symbol() {
-  using namespace boost::xpressive;
-  return !boost::xpressive::range('0', '9') >> +(re_non_special()) >> *(re_symbol_end());
-}
+      if (token.mType == XYToken::OPEN)
+        ++depth;
+      else if (token.mType == XYToken::CLOSE)
+        --depth;
+      if (token.mType != XYToken::COMMENT)
+        reader = is_queue_reader(token);
+      scanned = token.mEnd - first;
+      token = next_token(token.mEnd, last);
+    }
 
-// Return regex for a character in a string
-boost::xpressive::sregex re_stringchar() {
-  using namespace boost::xpressive;
-  using boost::xpressive::set;
-  return ~(set= '\"','\\') | ('\\' >> _);
-}
+    if (complete && depth <= 0 && !reader) {
+      size_t queued = xy->mY.size();
+      parse(statement, back_inserter(xy->mY));
+      intern(xy, xy->mY.begin() + queued, xy->mY.end());
+      xy->eval();
 
-// Return regex for strings
-boost::xpressive::sregex re_string() {
-  using namespace boost::xpressive;
-  return as_xpr('\"') >> *(re_stringchar()) >> '\"';
+      // A ']' outside of any list ends parsing of the file
+      if (depth < 0)
+        return;
+
+      statement.clear();
+      scanned = 0;
+      depth = 0;
+      reader = false;
+    }
+  }
+
+  // Anything left is an unclosed list, string or comment
+  size_t queued = xy->mY.size();
+  parse(statement, back_inserter(xy->mY));
+  intern(xy, xy->mY.begin() + queued, xy->mY.end());
+  xy->eval();
 }
 
-// Return regex for comments
-boost::xpressive::sregex re_comment() {
-  using namespace boost::xpressive;
-  return as_xpr('*') >> '*' >> -*_ >> '*' >> '*';
+string read_source(char const* filename) {
+  char const* ext = strrchr(filename, '.');
+  bool literate = ext && strcmp(ext, ".lcf") == 0;
+  ifstream file(filename);
+
+  string source;
+  bool code = false;
+  string line;
+  while (next_source_line(file, literate, code, line)) {
+    source += line;
+    source += '\n';
+  }
+  return source;
 }
 
 // Copyright (C) 2009 Chris Double. All Rights Reserved.
@@ -8,11 +8,14 @@
 #include <set>
 #include <vector>
 #include <deque>
+#include <list>
 #include <sstream>
-#include <boost/xpressive/xpressive.hpp>
 #include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <gmpxx.h>
 #include "gc/gc.h"
+#include "smallvector.h"
 
 // XY is the object that contains the state of the running
 // system. For example, the stack (X), the queue (Y) and
@@ -22,6 +25,9 @@ class XY;
 // Forward declare classes
 class XYObject;
 class XYList;
+class XYPattern;
+class XYNative;
+class XYLookupCache;
 class XYPrimitive;
 class XYFloat;
 class XYInteger;
@@ -44,20 +50,82 @@ class XYSequence;
 // is used in the prototype lookup chain. A parent slot must be a data
 // slot.
 //
-// The value held in the XYObject Slots map. This holds data
-// for the given slot.
-class XYSlot : public GCObject
+// The value held for each slot of an object.
+class XYSlot
 {
  public:
   XYObject* mMethod;
   XYObject* mValue;
-  bool mParent;
 
  public:
-  XYSlot(XYObject* method, XYObject* value, bool parent);
+  XYSlot(XYObject* method, XYObject* value);
+};
+
+// The layout of the slots of an object, shared by all objects that
+// had the same slots added in the same order. It maps a slot name
+// to the index of the slot's value in the object. Adding a slot
+// moves an object to the shape that follows from its current one,
+// which is created the first time it is needed.
+//
+// Shared shapes are kept for as long as the program runs, so an
+// object with many slots, or that has had a slot removed, gets a
+// dictionary shape of its own instead. That is changed in place as
+// slots are added and removed.
+class XYShape : public GCObject
+{
+ public:
+  // Objects with more slots than this get a dictionary shape
+  enum { MAX_SHARED_SLOTS = 32 };
+
+  // Shapes reached from a shape with this many transitions are
+  // dictionary shapes
+  enum { MAX_TRANSITIONS = 64 };
+
+  // Index of each slot by name
+  typedef std::map<std::string, size_t> Offsets;
+  Offsets mOffsets;
+
+  // Name and parent flag of each slot by index
+  std::vector<std::string> mNames;
+  std::vector<bool> mParent;
+
+  // Indexes of the parent slots, ordered by name
+  std::vector<size_t> mParents;
+
+  // The shapes reached by adding a slot, keyed by name and
+  // parent flag.
+  typedef std::map<std::pair<std::string, bool>, XYShape*> Transitions;
+  Transitions mTransitions;
+
+  // True if the shape belongs to a single object. Lookups through
+  // it are not cached as it can change.
+  bool mDictionary;
+
+ public:
+  XYShape();
+
+  // The shape of an object with no slots
+  static XYShape* empty();
 
   // GCObject method
   virtual void markChildren();
+
+  // Return the index of the slot with the name, or -1 if there
+  // isn't one.
+  int find(std::string const& name) const;
+
+  // Return the shape of an object of this shape with the slot added
+  XYShape* add(std::string const& name, bool parent);
+
+  // Return a dictionary shape with the same slots
+  XYShape* dictionary() const;
+
+  // Add the slot to the end of a dictionary shape
+  void append(std::string const& name, bool parent);
+
+  // Remove the slot at 'index' from a dictionary shape. The
+  // following slots move down one.
+  void remove(size_t index);
 };
 
 // Base class for all objects in the XY system. Anything
@@ -67,9 +135,29 @@ class XYSlot : public GCObject
 class XYObject : public GCObject
 {
  public:    
-  // Mapping of slot name to getter/setter.
-  typedef std::map<std::string, XYSlot*> Slots;
-  Slots mSlots;
+  // The names of the slots and the value of each, in the
+  // order given by the shape. The slots are shared with copies
+  // of the object until one of them changes a slot, and are
+  // null if the object has never had slots.
+  typedef std::vector<XYSlot> Slots;
+  XYShape* mShape;
+  boost::shared_ptr<Slots> mSlots;
+
+  // True for shared constants such as the canonical empty list. These
+  // may be referenced from many places so must never be modified.
+  bool mImmutable;
+
+  // True once a cached lookup has searched the slots of the object.
+  // Adding or removing its slots, or setting a parent slot, then
+  // invalidates cached lookups.
+  bool mSearched;
+
+  // The lookup that last visited the object. Used instead of a set
+  // of visited objects to prevent infinite loops through parents.
+  unsigned long mVisit;
+
+  // Incremented for each lookup
+  static unsigned long Visit;
 
  public:
   XYObject();
@@ -82,19 +170,45 @@ class XYObject : public GCObject
 
   // Find the slot with the given name,
   // searching down the prototype chain as needed.
-  // 'circular' is used to prevent infinite loops
-  // while lookup up parent objects. The 'context'
-  // will hold a pointer to the object that where the
-  // slot was found. 'context' can be passed null in
-  // which case it is ignored.
+  // The 'context' will hold a pointer to the object
+  // that where the slot was found. 'context' can be
+  // passed null in which case it is ignored. If 'search'
+  // is true then every object visited is marked as
+  // searched. The slot returned is only valid until
+  // slots are added to or removed from the object it
+  // was found in.
+  XYSlot* lookup(std::string const& name, 
+		 XYObject** context,
+		 bool search = false);
+
+ private:
+  // Lookup of the slot by the lookup numbered 'visit'.
+  // Objects already stamped with 'visit' are skipped.
   XYSlot* lookup(std::string const& name, 
-		 std::set<XYObject*>& circular,
-		 XYObject** context);
+		 unsigned long visit,
+		 XYObject** context,
+		 bool search);
+
+ public:
 
   // Get the slot object if there is one, without
   // following the prototype lookup chain.
   XYSlot* getSlot(std::string const& name);
 
+  // The slot at 'index' in the shape. The slot may be shared
+  // with copies of the object so must not be changed through
+  // this pointer. Use setSlotValue instead.
+  XYSlot* slotAt(size_t index) const { return &(*mSlots)[index]; }
+
+  // Set the value held in the slot at 'index'
+  void setSlotValue(size_t index, XYObject* value);
+
+ private:
+  // Give the object its own copy of its slots
+  void unshare();
+
+ public:
+
   // Adds a slot
   void addSlot(std::string const& name, 
 	       XYObject* method,
@@ -141,6 +255,23 @@ class XYObject : public GCObject
   // a positive number if it is greater.
   virtual int compare(XYObject* rhs);
 
+  // Objects of different types are ordered by the rank of
+  // their type before any type specific comparison is done.
+  enum Rank {
+    NUMBER_RANK,
+    STRING_RANK,
+    SYMBOL_RANK,
+    SHUFFLE_RANK,
+    PRIMITIVE_RANK,
+    SEQUENCE_RANK,
+    OBJECT_RANK
+  };
+  virtual Rank rank() const;
+
+  // Return a hash of the object. Objects that compare
+  // equal must return the same hash.
+  virtual size_t hash();
+
   // Math Operators
   DD(add);
   DD(subtract);
@@ -149,6 +280,59 @@ class XYObject : public GCObject
   DD(power);
 };
 
+// A polymorphic inline cache for the slot lookups made with one
+// name, held by the symbol or string naming the slot in a program.
+// A slot found in the receiver itself is cached by the receiver's
+// shape. Otherwise the result is cached by the receiver's shape and
+// parents and is only used while XYLookupCache::Epoch is unchanged.
+class XYLookupCache : public GCObject
+{
+ public:
+  class Entry {
+    public:
+      // The shape of the receiver. Zero if the entry is unused.
+      XYShape* mShape;
+
+      // True if the slot is in the receiver
+      bool mOwn;
+
+      // Otherwise the values of the receiver's parent slots, the
+      // object the slot was found in and Epoch at the time. The
+      // holder is zero if no slot was found.
+      std::vector<XYObject*> mParents;
+      XYObject* mHolder;
+      unsigned long mEpoch;
+
+      // Index of the slot in the receiver or holder
+      size_t mIndex;
+
+    public:
+      Entry();
+  };
+
+  enum { SIZE = 4 };
+  Entry mEntries[SIZE];
+
+  // The entry replaced by the next miss
+  size_t mNext;
+
+  // The name the entries were made for
+  std::string mName;
+
+  // Incremented when cached lookups may have changed
+  static unsigned long Epoch;
+
+ public:
+  XYLookupCache();
+
+  // GCObject method
+  virtual void markChildren();
+
+  // Look up the slot 'name' as XYObject::lookup does, using and
+  // updating the entries.
+  XYSlot* lookup(XYObject* receiver, std::string const& name, XYObject** context);
+};
+
 // All number objects are derived from this class.
 class XYNumber : public XYObject
 {
@@ -162,6 +346,7 @@ class XYNumber : public XYObject
 
   public:
     XYNumber(Type type);
+    virtual Rank rank() const;
 
     // Returns true if the number is zero
     virtual bool is_zero() const = 0;
@@ -186,6 +371,7 @@ class XYFloat : public XYNumber
     XYFloat(mpf_class const& v);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual int compare(XYObject* rhs);
+    virtual size_t hash();
     DD(add);
     DD(subtract);
     DD(multiply);
@@ -210,6 +396,7 @@ class XYInteger : public XYNumber
     XYInteger(mpz_class const& v);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual int compare(XYObject* rhs);
+    virtual size_t hash();
     DD(add);
     DD(subtract);
     DD(multiply);
@@ -228,11 +415,20 @@ class XYSymbol : public XYObject
   public:
     std::string mValue;
 
+    // Cache for slot lookups of the symbol. Zero until the first.
+    XYLookupCache* mLookupCache;
+
   public:
     XYSymbol(std::string v);
+    virtual void markChildren();
+
+    // Look up the slot named by the symbol in 'receiver' using the cache
+    XYSlot* lookupSlot(XYObject* receiver, XYObject** context);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual void eval1(XY* xy);
     virtual int compare(XYObject* rhs);
+    virtual Rank rank() const;
+    virtual size_t hash();
 };
 
 // A shuffle symbol describes pattern to rearrange the stack.
@@ -242,23 +438,44 @@ class XYShuffle : public XYObject
     std::string mBefore;
     std::string mAfter;
 
+    // How the shuffle is applied. DROP leaves the first items of
+    // mBefore in place and COPY leaves them all and pushes more.
+    // Other shapes are a GENERAL permutation.
+    enum Shape {
+      DROP,
+      COPY,
+      SWAP,
+      GENERAL
+    };
+    Shape mShape;
+
+    // For each item of mAfter, the index in mBefore of the item
+    // it copies.
+    std::vector<unsigned char> mOrder;
+
   public:
     XYShuffle(std::string v);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual void eval1(XY* xy);
     virtual int compare(XYObject* rhs);
+    virtual Rank rank() const;
+    virtual size_t hash();
 };
 
 // A base class for a sequence of XYObject's
 class XYSequence : public XYObject
 {
   public:
-    typedef std::vector<XYObject*> List;
+    // Most sequences are short so a few elements are stored
+    // without a separate allocation.
+    typedef SmallVector<XYObject*, 4> List;
     typedef List::iterator iterator;
     typedef List::const_iterator const_iterator;
 
   public:
     virtual int compare(XYObject* rhs);
+    virtual Rank rank() const;
+    virtual size_t hash();
     DD(add);
     DD(subtract);
     DD(multiply);
@@ -268,6 +485,10 @@ class XYSequence : public XYObject
     // Returns the size of the sequence
     virtual size_t size() = 0;
 
+    // Returns true if the sequence has no elements. Lazy
+    // sequences override this to avoid computing their size.
+    virtual bool empty();
+
     // Inserts all elements of this sequence into the C++ container
     virtual void pushBackInto(List& list) = 0;
 
@@ -293,10 +514,20 @@ class XYString : public XYSequence
   public:
     std::string mValue;
 
+    // Cache for slot lookups of the string. Zero until the first.
+    XYLookupCache* mLookupCache;
+
   public:
     XYString(std::string v);
+    virtual void markChildren();
+
+    // Look up the slot named by the string in 'receiver' using the cache
+    XYSlot* lookupSlot(XYObject* receiver, XYObject** context);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual void eval1(XY* xy);
     virtual int compare(XYObject* rhs);
+    virtual Rank rank() const;
+    virtual size_t hash();
     virtual size_t size();
     virtual void pushBackInto(List& list);
     virtual XYObject* at(size_t n);
@@ -314,12 +545,21 @@ class XYList : public XYSequence
   public:
     List mList;
 
+    // The compiled form of this list when it has been used
+    // as a pattern by '(' or ')'. Zero if it hasn't been.
+    XYPattern* mPattern;
+
+    // Native code for the list when it is the body of a word
+    // compiled by 'cfc'. Zero if there isn't any.
+    XYNative* mNative;
+
   public:
     XYList();
     template <class InputIterator> XYList(InputIterator first, InputIterator last);
     
     virtual void markChildren();
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual void eval1(XY* xy);
     virtual size_t size();
     virtual void pushBackInto(List& list);
     virtual XYObject* at(size_t n);
@@ -375,6 +615,38 @@ class XYJoin : public XYSequence
     XYJoin() { }
     XYJoin(XYSequence* first, XYSequence* second); 
 
+    // Add 'sequence' to the end of the join.
+    void append(XYSequence* sequence);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+};
+
+// A range is a virtual sequence of integers from 'start' up to,
+// but not including, 'stop' in increments of 'step'. Elements are
+// only boxed into XYIntegers as they are accessed.
+class XYRange : public XYSequence
+{
+  public:
+    long mStart;
+    long mStop;
+    long mStep;
+
+    // Boxed elements of the range. Empty until the range is
+    // modified with 'set_at', after which the range behaves
+    // as a list of these elements.
+    List mElements;
+
+  public:
+    XYRange(long start, long stop, long step = 1);
+
     virtual void markChildren();
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual size_t size();
@@ -386,6 +658,94 @@ class XYJoin : public XYSequence
     virtual XYSequence* join(XYSequence* rhs);
 };
 
+// Storage for the elements of a stream created by 'unfold'. The
+// elements are computed one at a time, as they are first needed, by
+// calling the quotations with the current seed. They are kept in
+// fixed size chunks so that a long stream is a short chain of chunks
+// and chunks that are no longer referenced can be collected.
+class XYStreamChunk : public GCObject
+{
+  public:
+    enum { CAPACITY = 64 };
+
+    // The interpreter used to call the quotations. They run in a
+    // nested evaluation, see XY::apply, so must be synchronous.
+    XY* mXY;
+
+    // Ends the stream when true for the seed
+    XYSequence* mPredicate;
+
+    // Computes the element from the seed
+    XYSequence* mValue;
+
+    // Computes the next seed from the seed
+    XYSequence* mNext;
+
+    // The stack when the stream was created. The quotations
+    // see a copy of it below the seed.
+    XYList* mStack;
+
+    // Seed for the next element of this chunk. Zero when the
+    // stream has ended or the chunk is full.
+    XYObject* mSeed;
+
+    // Elements computed so far
+    std::vector<XYObject*> mElements;
+
+    // The following chunk. Created when this chunk is full.
+    XYStreamChunk* mNextChunk;
+
+  public:
+    XYStreamChunk(XY* xy,
+                  XYObject* seed,
+                  XYSequence* predicate,
+                  XYSequence* value,
+                  XYSequence* next,
+                  XYList* stack);
+
+    virtual void markChildren();
+
+    // Compute elements until index 'n' of this chunk is
+    // available. Returns false if the stream ends first.
+    bool force(size_t n);
+};
+
+// A lazy sequence whose elements are computed on demand and
+// memoized. Refers to an element within a chunk, so 'tail'
+// is constant time.
+class XYStream : public XYSequence
+{
+  public:
+    // Number of elements printing computes
+    enum { PRINT_LIMIT = 100 };
+
+    XYStreamChunk* mChunk;
+    size_t mOffset;
+
+  public:
+    XYStream(XYStreamChunk* chunk, size_t offset);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual bool empty();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+
+    // Returns true if the stream has an element at index 'n',
+    // computing only the elements up to it.
+    bool has(size_t n) const;
+
+  private:
+    // Find the chunk and index holding element 'n'. Returns
+    // false if the stream has fewer elements.
+    bool locate(size_t n, XYStreamChunk*& chunk, size_t& index) const;
+};
+
 // A primitive is the implementation of a core function.
 // Primitives execute immediately when taken off the queue
 // and do not need to have their value looked up.
@@ -400,6 +760,406 @@ class XYPrimitive : public XYObject
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual void eval1(XY* xy);
     virtual int compare(XYObject* rhs);
+    virtual Rank rank() const;
+    virtual size_t hash();
+};
+
+// An iteration is queued by the native 'pmap', 'pfilter', 'peach'
+// and 'sort-by' primitives. The quotation for the current element runs on the queue
+// ahead of it. When the iteration itself is evaluated it collects the
+// result of that quotation and queues the quotation for the next
+// element. Running the quotation on the queue rather than in a nested
+// interpreter keeps '$', asynchronous primitives and limits working
+// the same as they did with the prelude definitions. The quotation
+// also sees the stack those definitions left below the element: the
+// rest of the sequence for 'peach', and the rest and the results so
+// far for 'pmap' and 'pfilter'.
+class XYIteration : public XYObject
+{
+  public:
+    enum Type {
+      MAP,
+      FILTER,
+      EACH,
+      SORT
+    } mType;
+
+    // The sequence being iterated over. Other than for SORT the
+    // current element is its head.
+    XYSequence* mSequence;
+
+    // The quotation called for each element
+    XYSequence* mQuotation;
+
+    // The result being built. Null for EACH. For MAP and FILTER the
+    // results are stored from the back of the list, most recent
+    // first, so the results so far are a slice of it. For SORT these
+    // are the keys that the sequence is sorted by.
+    XYList* mResult;
+
+    // The index of the element the quotation is being run on. Zero
+    // other than for SORT.
+    size_t mIndex;
+
+    // The index of the first result in mResult for MAP and FILTER
+    size_t mStart;
+
+    // The rest of the sequence and the results so far pushed below
+    // the element. Zero until the iteration is started.
+    XYSequence* mRest;
+    XYSequence* mSoFar;
+
+  public:
+    XYIteration(Type type,
+                XYSequence* sequence,
+                XYSequence* quotation,
+                XYList* result,
+                size_t index,
+                size_t start);
+
+    // Push the current element on the stack and queue the
+    // quotation to be called on it, followed by this object.
+    void start(XY* xy);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual void eval1(XY* xy);
+};
+
+// A dictionary mapping keys to values. Keys can be any object and
+// are matched structurally using 'hash' and 'compare'. Entries are
+// stored in a single open addressed table using linear probing so
+// a lookup usually touches one or two adjacent entries. As with
+// sequences, a key that is modified after being added to the
+// dictionary can no longer be found.
+class XYDictionary : public XYObject
+{
+  public:
+    struct Entry {
+      enum State {
+        EMPTY,
+        USED,
+        REMOVED
+      } mState;
+      size_t mHash;
+      XYObject* mKey;
+      XYObject* mValue;
+
+      Entry() : mState(EMPTY), mHash(0), mKey(0), mValue(0) { }
+    };
+    typedef std::vector<Entry> Entries;
+
+    // The table. Its size is always a power of two.
+    Entries mEntries;
+
+    // Number of USED entries
+    size_t mSize;
+
+    // Number of USED and REMOVED entries. Removed entries
+    // are reclaimed when the table grows.
+    size_t mFilled;
+
+  public:
+    XYDictionary();
+
+    virtual void markChildren();
+    virtual XYObject* copy() const;
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+
+    // Returns the value stored for the key or null if
+    // there is none.
+    XYObject* get(XYObject* key);
+
+    // Add or replace the value stored for the key
+    void put(XYObject* key, XYObject* value);
+
+    // Remove the key if it exists. Returns true if
+    // it was removed.
+    bool remove(XYObject* key);
+
+    // Number of keys in the dictionary
+    size_t size() const;
+
+    // Store all the keys in the container
+    void keys(XYSequence::List& out) const;
+
+  private:
+    // Returns the index of the entry holding the key, or of
+    // the entry it should be stored in if it is not there.
+    size_t find(XYObject* key, size_t hash);
+
+    // Rebuild the table with the given number of entries
+    void resize(size_t capacity);
+};
+
+// An immutable set. Elements are kept in the order they were
+// first added so a set can be used as a sequence, and are indexed
+// by hash so membership tests don't scan the elements.
+class XYSet : public XYSequence
+{
+  public:
+    // The elements in insertion order
+    List mList;
+
+    // Maps each element to its index in mList
+    XYDictionary* mIndex;
+
+  public:
+    XYSet();
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+
+    // Add the object if it is not already an element. Sets
+    // are immutable once they are visible to cf code, so this
+    // is only used while building a set.
+    void insert(XYObject* o);
+
+    // Returns the index of the object in the set, or the size
+    // of the set if it is not an element.
+    size_t find(XYObject* o);
+};
+
+// A pattern used by the '(' and ')' primitives, compiled so it can
+// be applied without looking up variables by name. The first item of
+// the pattern is compiled to a tree of nodes that bind the values on
+// the stack to numbered variables. The remaining items are compiled
+// to a template that is copied with the variables filled in.
+//
+// The nodes keep the items they were compiled from. A pattern list
+// can be modified with '!' or ',' so 'unchanged' is checked before a
+// cached pattern is used and it is recompiled if the list differs.
+class XYPattern : public GCObject
+{
+  public:
+    // LIST nodes are followed by the nodes for their items. A LIST
+    // in a template holds an XYList, a SEQUENCE holds any other
+    // sequence and is copied item by item. A VARIABLE binds or is
+    // replaced by a variable. REST binds the remaining items of the
+    // sequence. OTHER matches nothing or is copied unchanged.
+    enum Kind {
+      LIST,
+      SEQUENCE,
+      VARIABLE,
+      REST,
+      OTHER
+    };
+
+    class Node {
+      public:
+        Kind mKind;
+
+        // The pattern item this node was compiled from
+        XYObject* mObject;
+
+        // The variable number for VARIABLE and REST nodes
+        int mVariable;
+
+        // The index following the nodes for this item
+        size_t mEnd;
+    };
+    typedef std::vector<Node> Nodes;
+
+    // Nodes for the first item of the pattern
+    Nodes mMatch;
+
+    // Nodes for each of the remaining items of the pattern
+    Nodes mTemplate;
+
+    // Index in mTemplate of the first node for each item
+    std::vector<size_t> mItems;
+
+    // Variable numbers by name
+    std::map<std::string, int> mVariables;
+
+  public:
+    XYPattern();
+
+    virtual void markChildren();
+
+    // Compile the pattern. Returns false if it contains something
+    // the compiled form can't handle, in which case the pattern
+    // must be applied with XY::getPatternValues and replacePattern.
+    bool compile(XYSequence* pattern);
+
+    // True if the pattern is still the one that was compiled
+    bool unchanged(XYSequence* pattern);
+
+    // Remove the values the pattern matches from the stack, then
+    // append the filled in template to the stack or prepend it to
+    // the queue.
+    void apply(XY* xy, bool queue);
+
+  private:
+    bool compileMatch(XYObject* object);
+    void compileTemplate(XYObject* object);
+    void match(XYObject** values, size_t n, XYObject* object, XYSequence* sequence, size_t i);
+    void bind(XYObject** values, int variable, XYObject* value);
+    XYObject* fill(XYObject** values, size_t n);
+    XYObject* replace(XYObject** values, XYObject* object);
+};
+
+// A least recently used cache of parsed programs keyed by their
+// source, so that source evaluated repeatedly, like lines typed at
+// the REPL or code given to the IRC bot, is only lexed and parsed
+// once. The cached programs are never evaluated. A copy is returned
+// from each lookup so the cached program can't be modified.
+class XYParseCache : public GCObject
+{
+  public:
+    // Keys in order of use, most recent first
+    typedef std::list<std::string> Order;
+
+    class Entry {
+      public:
+        XYList* mProgram;
+
+        // Approximate memory used by the entry
+        size_t mBytes;
+
+        // Position of the key in mOrder
+        Order::iterator mPosition;
+    };
+    typedef std::map<std::string, Entry> Entries;
+
+    Entries mEntries;
+    Order mOrder;
+
+    // Approximate memory used by all entries, and the most
+    // that the cache will use before discarding entries.
+    size_t mBytes;
+    size_t mLimit;
+
+    // Lookups that did and did not find a program
+    unsigned long mHits;
+    unsigned long mMisses;
+
+  public:
+    XYParseCache(size_t limit);
+
+    virtual void markChildren();
+
+    // Returns a copy of the program cached for the key, or
+    // null if there isn't one.
+    XYList* find(std::string const& key);
+
+    // Cache a copy of the program parsed from the key
+    void insert(std::string const& key, XYList* program);
+};
+
+// Hash-consing of the objects made by the parser. Structurally equal
+// literals are replaced by one canonical object, so a program that is
+// parsed many times, or repeats a quotation, holds one copy of it and
+// comparing equal literals is a pointer compare. Canonical objects are
+// shared and so are made immutable. They are copied on write: a list
+// or string literal pushes a copy of itself, with the shared lists and
+// strings in it copied too, when evaluated, and '!' with a path copies
+// the shared lists it writes into.
+class XYInterner : public GCObject
+{
+  public:
+    // The canonical objects, keyed by type and contents. The key
+    // of a list is made from the addresses of its canonical items.
+    typedef std::map<std::string, XYObject*> Objects;
+    Objects mObjects;
+
+    // Number of objects held before the table is emptied
+    size_t mLimit;
+
+  public:
+    XYInterner(size_t limit);
+
+    virtual void markChildren();
+
+    // Return the canonical object equal to 'o', which must have been
+    // made by the parser. The items of a list are replaced by their
+    // canonical objects.
+    XYObject* intern(XYObject* o);
+};
+
+class XYNativeFrame;
+
+// The C++ function that 'cfc' generates for the body of a word
+typedef void (*XYNativeFunction)(XYNativeFrame& frame);
+
+// A word compiled to C++ by 'cfc'. 'mSource' is the body of the
+// word the function was generated from, as printed by toString(true).
+class XYCompiledWord {
+  public:
+    std::string mSource;
+    XYNativeFunction mFunction;
+};
+typedef std::map<std::string, XYCompiledWord> XYCompiledWords;
+
+// The native code for a list. 'set' attaches it to a list that is
+// the body of a compiled word and '.' runs it instead of queueing
+// the items of the list. The items are recorded so that the native
+// code is only used while the list still holds them.
+class XYNative : public GCObject
+{
+  public:
+    XYNativeFunction mFunction;
+
+    // The items of the list when the code was attached
+    XYSequence::List mItems;
+
+    // The primitive that each item names, or zero if the item
+    // isn't a symbol for a primitive.
+    std::vector<XYPrimitive*> mPrimitives;
+
+  public:
+    XYNative(XY* xy, XYNativeFunction function, XYList* list);
+
+    virtual void markChildren();
+
+    // True if the list holds the items the code was attached with
+    bool unchanged(XYList* list);
+
+    // Evaluate the items of the list
+    void run(XY* xy);
+};
+
+// The state of running native code. The generated function calls a
+// method for each item of the list in order. A method returns false
+// when the items from then on must be left to the interpreter, for
+// example when a primitive has queued a quotation. Those items are
+// queued when the function returns or throws.
+class XYNativeFrame {
+  public:
+    XY* mXY;
+    XYNative* mNative;
+
+    // Size of the queue when the code started
+    size_t mQueueSize;
+
+    // The next item to evaluate
+    size_t mNext;
+
+  public:
+    XYNativeFrame(XY* xy, XYNative* native);
+
+    // Push item 'i', a literal, on the stack
+    void push(size_t i);
+
+    // Evaluate item 'i', a shuffle
+    void shuffle(size_t i);
+
+    // Evaluate item 'i', a symbol naming a primitive
+    bool primitive(size_t i);
+
+    // Evaluate item 'i', a symbol, followed by the '.' at item
+    // 'i+1', running the native code of the word it names.
+    bool call(size_t i);
+
+    // Queue the items that haven't been evaluated
+    void resume();
 };
 
 // Base class to to provide limits to the executing
@@ -442,7 +1202,8 @@ class XYError {
     LIMIT_REACHED,
     RANGE,
     INVALID_SLOT_TYPE,
-    SLOT_NOT_FOUND
+    SLOT_NOT_FOUND,
+    IMMUTABLE
   };
 
   // The interpreter state at the time of the error
@@ -521,6 +1282,25 @@ class XY : public GCObject {
     // True if we are a 'repl' based interpreter
     bool mRepl;
 
+    // Stacks and queues put aside by 'apply' while it
+    // evaluates a quotation.
+    std::deque<std::pair<XYStack, XYQueue> > mSaved;
+
+    // Programs parsed from the REPL and by 'parse'. Shared
+    // with the threads the interpreter creates.
+    XYParseCache* mParseCache;
+
+    // Hash-conses parsed programs. Zero if that is turned off,
+    // otherwise shared with the threads the interpreter creates.
+    XYInterner* mInterner;
+
+    // Words compiled to C++ by 'cfc'. Their native code is
+    // attached to the body when the word is 'set'.
+    XYCompiledWords mCompiledWords;
+
+    // The native code being run, innermost last
+    std::vector<XYNative*> mNatives;
+
   public:
     // Constructor installs any primitives into the
     // environment.
@@ -553,6 +1333,14 @@ class XY : public GCObject {
     // Evaluate all items in the queue.
     virtual void eval();
 
+    // Evaluate 'quotation' with 'value' on a fresh stack and return
+    // the item left on top of it. If 'stack' is given the fresh stack
+    // starts with a copy of its items below 'value'. The current stack
+    // and queue are restored afterwards. This lets C++ code call back
+    // into cf. The quotation cannot use primitives that wait for
+    // asynchronous events.
+    XYObject* apply(XYObject* value, XYSequence* quotation, XYList* stack = 0);
+
     // Perform a recursive match of pattern values to items
     // in the given stack.
     template <class OutputIterator>
@@ -576,37 +1364,92 @@ class XY : public GCObject {
     void replacePattern(XYEnv const& env, XYObject* object, OutputIterator out);
 };
 
-// Return regex for tokenizing
-boost::xpressive::sregex re_integer();
-boost::xpressive::sregex re_float();
-boost::xpressive::sregex re_number();
-boost::xpressive::sregex re_special();
-boost::xpressive::sregex re_non_special();
-boost::xpressive::sregex re_symbol();
-boost::xpressive::sregex re_stringchar();
-boost::xpressive::sregex re_string();
-boost::xpressive::sregex re_comment();
+// A token in program source. The text of the token is the
+// range [mBegin, mEnd).
+class XYToken {
+  public:
+    enum Type {
+      COMMENT,
+      STRING,
+      FLOAT,
+      INTEGER,
+      OPEN,
+      CLOSE,
+      SHUFFLE,
+      SYMBOL,
+      END
+    } mType;
+    char const* mBegin;
+    char const* mEnd;
+};
+
+// Scan the next token in [first, last), skipping leading whitespace.
+// Returns a token of type END when there are no more tokens.
+XYToken next_token(char const* first, char const* last);
+
+// Return the type of a complete token, as given by the 'tokenize'
+// primitive, when parsed on its own.
+XYToken::Type classify_token(char const* first, char const* last);
+
+// Create the object for a token. The token must not be a
+// COMMENT, OPEN, CLOSE or END token.
+XYObject* token_object(XYToken const& token);
+
+// The shared, immutable empty list
+XYList* empty_list();
 
 // Given an input string, unescape any special characters
 std::string unescape(std::string s);
 std::string escape(std::string s);
 
 // Returns true if the string is a shuffle pattern
-bool is_shuffle_pattern(std::string s);
+bool is_shuffle_pattern(char const* first, char const* last);
+bool is_shuffle_pattern(std::string const& s);
 
 // Given a string, store a sequence of XY tokens using the 'out' iterator
 // to put them in a container.
-template <class InputIterator, class OutputIterator>
-void tokenize(InputIterator first, InputIterator last, OutputIterator out)
+template <class OutputIterator>
+void tokenize(char const* first, char const* last, OutputIterator out)
 {
+  XYToken token = next_token(first, last);
+  while (token.mType != XYToken::END) {
+    *out++ = std::string(token.mBegin, token.mEnd);
+    token = next_token(token.mEnd, last);
+  }
+}
+
+// Parse the source in [first, last) storing the resulting objects
+// using the given output iterator. Returns the position after a
+// closing ']' or the end of input.
+template <class OutputIterator>
+char const* parse(char const* first, char const* last, OutputIterator out) {
   using namespace std;
-  using namespace boost::xpressive;
 
-  // inline string regular expression. Without this I get a 'pure virtual function'
-  // called inside the boost regular expression code when compiled with -O2 and -O3.
-  sregex xy = re_comment() | (as_xpr('\"') >> *(re_stringchar()) >> '\"') | re_float() | re_special() | re_symbol() | re_integer();
-  sregex_token_iterator begin(first, last, xy), end;
-  copy(begin, end, out);
+  XYToken token = next_token(first, last);
+  while (token.mType != XYToken::END) {
+    first = token.mEnd;
+    switch (token.mType) {
+    case XYToken::COMMENT:
+      // Ignore comments
+      break;
+
+    case XYToken::OPEN: {
+      XYList* list = new XYList();
+      first = parse(first, last, back_inserter(list->mList));
+      *out++ = list;
+      break;
+    }
+
+    case XYToken::CLOSE:
+      return first;
+
+    default:
+      *out++ = token_object(token);
+    }
+    token = next_token(first, last);
+  }
+
+  return first;
 }
 
 // Parse a sequence of tokens storing the result using the
@@ -614,35 +1457,30 @@ void tokenize(InputIterator first, InputIterator last, OutputIterator out)
 template <class InputIterator, class OutputIterator>
 InputIterator parse(InputIterator first, InputIterator last, OutputIterator out) {
   using namespace std;
-  using namespace boost::xpressive;
 
   while (first != last) {
-    string token = *first++;
-    smatch what;
-    if (regex_match(token, what, re_comment())) {
+    string text = *first++;
+    XYToken token;
+    token.mBegin = text.data();
+    token.mEnd = token.mBegin + text.size();
+    token.mType = classify_token(token.mBegin, token.mEnd);
+    switch (token.mType) {
+    case XYToken::COMMENT:
       // Ignore comments
-    }
-    else if (regex_match(token, what, re_string())) {
-      *out++ = new XYString(unescape(token.substr(1, token.size()-2)));
-    }
-    else if(regex_match(token, re_float()))
-      *out++ = new XYFloat(token);
-    else if(regex_match(token, re_integer())) {
-      *out++ = new XYInteger(token);
-    }
-    else if(token == "[") {
+      break;
+
+    case XYToken::OPEN: {
       XYList* list = new XYList();
       first = parse(first, last, back_inserter(list->mList));
       *out++ = list;
+      break;
     }
-    else if( token == "]") {
+
+    case XYToken::CLOSE:
       return first;
-    }
-    else if(is_shuffle_pattern(token)) {
-      *out++ = new XYShuffle(token);
-    }
-    else {
-      *out++ = new XYSymbol(token);
+
+    default:
+      *out++ = token_object(token);
     }
   }
 
@@ -652,15 +1490,27 @@ InputIterator parse(InputIterator first, InputIterator last, OutputIterator out)
 // Parse a string into XY objects, storing the result in the
 // container pointer to by the output iterator.
 template <class OutputIterator>
-void parse(std::string s, OutputIterator out) {
-  using namespace std;
-  using namespace boost;
-
-  vector<string> tokens;
-  tokenize(s.begin(), s.end(), back_inserter(tokens));
-  parse(tokens.begin(), tokens.end(), out);
+void parse(std::string const& s, OutputIterator out) {
+  char const* first = s.data();
+  parse(first, first + s.size(), out);
 }
 
+// Load a source file, evaluating each statement before the next is
+// read. A statement is a run of lines that ends outside of any list,
+// string or comment, and not with one of ' $ or $$, so a file is
+// evaluated as if its statements were entered at the repl. Words
+// that read the queue only see the rest of their statement. Files
+// ending in '.lcf' are literate files, see literate.lcf for details.
+void load_file(XY* xy, char const* filename);
+
+// Return the code in a source file, without the prose if it is a
+// literate file.
+std::string read_source(char const* filename);
+
+// If 'name' is a word compiled by 'cfc' and 'value' is the body it
+// was compiled from, attach the native code for the word to 'value'.
+void attach_native(XY* xy, std::string const& name, XYObject* value);
+
 // Assert a condition is true and throw an XYError if it is not
 #define xy_assert(condition, code) \
   xy_assert_impl((condition), (code), xy, __FILE__, __LINE__)
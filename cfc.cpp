@@ -0,0 +1,190 @@
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// See the license at the end of this file
+//
+// cfc compiles the words defined in cf source files to C++.
+//
+//   cfc name file...
+//
+// Each top level '[body] word set' in the files becomes a C++ function
+// that evaluates the body. The C++ is written to stdout along with an
+// 'install_<name>_primitives(XY*)' function that registers the words
+// with an interpreter. When that interpreter sets a word to the same
+// body the native code is attached to it, and '.' then runs the
+// function instead of queueing the items. If the word is later set
+// to a different body it is interpreted as usual.
+//
+// The function evaluates the body until it reaches an item that
+// needs the interpreter, such as a primitive that reads the queue
+// or a symbol that isn't followed by '.', and queues the remaining
+// items. Literals, shuffles, primitives and calls to other compiled
+// words are evaluated natively.
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <iterator>
+#include <typeinfo>
+#include "cf.h"
+
+using namespace std;
+
+// Primitives that read or replace the queue. They see the queue
+// differently when the rest of the body hasn't been queued yet.
+static char const* queue_primitives[] = { "'", "$", "$$", "call-method", 0 };
+
+static bool is_native_primitive(XY* xy, string const& name) {
+  for (char const** p = queue_primitives; *p; ++p) {
+    if (name == *p)
+      return false;
+  }
+  return xy->mP.find(name) != xy->mP.end();
+}
+
+static bool is_symbol(XYObject* o, char const* name) {
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(o);
+  return symbol && symbol->mValue == name;
+}
+
+// Return the statements that evaluate the body, one per item
+// until an item needs the interpreter.
+static vector<string> compile(XY* xy, XYList* body) {
+  vector<string> result;
+  XYSequence::List& items = body->mList;
+  for (size_t i=0; i < items.size(); ++i) {
+    XYObject* item = items[i];
+    type_info const& type = typeid(*item);
+    ostringstream s;
+    if (type == typeid(XYShuffle))
+      s << "f.shuffle(" << i << ")";
+    else if (type == typeid(XYSymbol)) {
+      string const& name = static_cast<XYSymbol*>(item)->mValue;
+      if (is_native_primitive(xy, name))
+        s << "!f.primitive(" << i << ")";
+      else if (xy->mP.find(name) == xy->mP.end() &&
+               i + 1 < items.size() && is_symbol(items[i + 1], ".")) {
+        s << "!f.call(" << i << ")";
+        ++i;
+      }
+      else
+        break;
+    }
+    else
+      s << "f.push(" << i << ")";
+    result.push_back(s.str());
+  }
+  return result;
+}
+
+// Write a string as a C++ string literal
+static void write_string(ostream& out, string const& s) {
+  out << '"';
+  for (string::const_iterator it = s.begin(); it != s.end(); ++it) {
+    unsigned char c = *it;
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < ' ' || c > '~') {
+      char octal[5];
+      sprintf(octal, "\\%03o", c);
+      out << octal;
+    }
+    else
+      out << c;
+  }
+  out << '"';
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    cerr << "Usage: cfc name file..." << endl;
+    return 1;
+  }
+
+  boost::asio::io_service io;
+  XY* xy(new XY(io));
+
+  // The definitions in order, with a later definition of a
+  // word replacing an earlier one.
+  vector<pair<string, XYList*> > words;
+  for (int i=2; i < argc; ++i) {
+    XYStack items;
+    parse(read_source(argv[i]), back_inserter(items));
+    for (size_t j=0; j + 2 < items.size(); ++j) {
+      XYList* body = dynamic_cast<XYList*>(items[j]);
+      XYSymbol* name = dynamic_cast<XYSymbol*>(items[j + 1]);
+      if (!body || !name || !is_symbol(items[j + 2], "set"))
+        continue;
+
+      vector<pair<string, XYList*> >::iterator it = words.begin();
+      while (it != words.end() && (*it).first != name->mValue)
+        ++it;
+      if (it != words.end())
+        words.erase(it);
+      words.push_back(make_pair(name->mValue, body));
+    }
+  }
+
+  cout << "// Generated by cfc from";
+  for (int i=2; i < argc; ++i)
+    cout << " " << argv[i];
+  cout << ". Do not edit." << endl;
+  cout << "#include \"cf.h\"" << endl;
+
+  vector<pair<string, XYList*> > compiled;
+  for (size_t i=0; i < words.size(); ++i) {
+    vector<string> statements = compile(xy, words[i].second);
+    if (statements.empty())
+      continue;
+
+    cout << endl;
+    cout << "// " << words[i].second->toString(true) << " " << words[i].first << " set" << endl;
+    cout << "static void word_" << compiled.size() << "(XYNativeFrame& f) {" << endl;
+    for (size_t j=0; j < statements.size(); ++j) {
+      string const& s = statements[j];
+      if (j + 1 < statements.size() && s[0] == '!')
+        cout << "  if (" << s << ") return;" << endl;
+      else
+        cout << "  " << (s[0] == '!' ? s.substr(1) : s) << ";" << endl;
+    }
+    cout << "}" << endl;
+    compiled.push_back(words[i]);
+  }
+
+  cout << endl;
+  cout << "void install_" << argv[1] << "_primitives(XY* xy) {" << endl;
+  cout << "  XYCompiledWord word;" << endl;
+  for (size_t i=0; i < compiled.size(); ++i) {
+    cout << "  word.mSource = ";
+    write_string(cout, compiled[i].second->toString(true));
+    cout << ";" << endl;
+    cout << "  word.mFunction = word_" << i << ";" << endl;
+    cout << "  xy->mCompiledWords[";
+    write_string(cout, compiled[i].first);
+    cout << "] = word;" << endl;
+  }
+  cout << "}" << endl;
+  return 0;
+}
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// The original author of this code can be contacted at: chris.double@double.co.nz
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// DEVELOPERS AND CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
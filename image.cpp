@@ -0,0 +1,1062 @@
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// See the license at the end of this file
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <typeinfo>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/cstdint.hpp>
+#include <boost/lexical_cast.hpp>
+#include "image.h"
+
+using namespace std;
+using namespace boost;
+
+// Layout of an image file. All numbers are stored in native byte
+// order, images are not intended to be moved between machines.
+//
+//   magic    8 bytes, "cfimage" followed by a zero byte
+//   version  u32
+//   count    u32, number of object records
+//   env      u32 count, then a string name and a ref for each entry
+//   stack    u32 count, then a ref for each item
+//   queue    u32 count, then a ref for each item
+//   frame    ref
+//   records  'count' object records
+//
+// A ref is a u32 holding the index of the object's record plus one,
+// or zero for a null pointer. A string is a u32 length followed by
+// the characters. Each record is a u8 tag, a u32 length and then
+// 'length' bytes of data. The data for an XYObject begins with its
+// immutable flag and its slots, followed by the data for its type.
+// Integers are stored as their raw GMP limbs, preceded by an i32
+// holding the number of limbs, negated if the integer is negative.
+//
+// A serialized value uses the same records with a different header:
+//
+//   magic    8 bytes, "cfvalue" followed by a zero byte
+//   version  u32
+//   count    u32, number of object records
+//   value    ref
+//   records  'count' object records
+
+static char const IMAGE_MAGIC[8] = { 'c', 'f', 'i', 'm', 'a', 'g', 'e', 0 };
+static char const VALUE_MAGIC[8] = { 'c', 'f', 'v', 'a', 'l', 'u', 'e', 0 };
+static uint32_t const IMAGE_VERSION = 3;
+
+enum ImageTag {
+  IMAGE_OBJECT,
+  IMAGE_FLOAT,
+  IMAGE_INTEGER,
+  IMAGE_SYMBOL,
+  IMAGE_SHUFFLE,
+  IMAGE_STRING,
+  IMAGE_LIST,
+  IMAGE_EMPTY_LIST,
+  IMAGE_SLICE,
+  IMAGE_JOIN,
+  IMAGE_RANGE,
+  IMAGE_STREAM_CHUNK,
+  IMAGE_STREAM,
+  IMAGE_PRIMITIVE,
+  IMAGE_DICTIONARY,
+  IMAGE_SET
+};
+
+typedef void (*PrimitiveFunction)(XY*);
+typedef map<string, PrimitiveFunction> PrimitiveTable;
+
+// Prefix for the keys of primitives that aren't in 'mP'
+static string const METHOD_PRIMITIVE = "primitives.";
+
+// Builds a table of the primitive functions an interpreter knows
+// about. Primitives are stored in an image by their key in this
+// table rather than by name as names are not unique. A primitive in
+// 'mP' is keyed by its name there. Those used by the methods of the
+// 'primitives' object are keyed by the method name with a prefix.
+static void primitive_table(XY* xy, PrimitiveTable& table) {
+  for (XYEnv::iterator it = xy->mP.begin(); it != xy->mP.end(); ++it) {
+    XYPrimitive* p = dynamic_cast<XYPrimitive*>((*it).second);
+    if (p)
+      table[(*it).first] = p->mFunc;
+  }
+
+  XYEnv::iterator it = xy->mEnv.find("primitives");
+  if (it != xy->mEnv.end() && (*it).second) {
+    XYObject* primitives = (*it).second;
+    XYShape::Offsets& offsets = primitives->mShape->mOffsets;
+    for (XYShape::Offsets::iterator sit = offsets.begin(); sit != offsets.end(); ++sit) {
+      XYSequence* method = dynamic_cast<XYSequence*>(primitives->slotAt((*sit).second)->mMethod);
+      if (!method || method->size() == 0)
+        continue;
+      XYObject* frame = method->at(0);
+      XYSlot* code = frame->getSlot("code");
+      XYSequence* list = code ? dynamic_cast<XYSequence*>(code->mValue) : 0;
+      if (!list)
+        continue;
+      for (size_t i=0; i < list->size(); ++i) {
+        XYPrimitive* p = dynamic_cast<XYPrimitive*>(list->at(i));
+        if (p)
+          table[METHOD_PRIMITIVE + (*sit).first] = p->mFunc;
+      }
+    }
+  }
+}
+
+// Floats are stored as a base 16 mantissa and a decimal exponent
+// so no precision is lost.
+static string float_to_string(mpf_class const& value) {
+  mp_exp_t exp;
+  string digits = value.get_str(exp, 16);
+  if (digits.empty())
+    return "0";
+
+  string sign;
+  if (digits[0] == '-') {
+    sign = "-";
+    digits.erase(0, 1);
+  }
+  return sign + "0." + digits + "@" + lexical_cast<string>(exp);
+}
+
+// Writes the records for an interpreter's objects
+class ImageWriter {
+  public:
+    XY* mXY;
+
+    // Objects that have been given a ref, in ref order
+    vector<GCObject*> mObjects;
+    map<GCObject*, uint32_t> mRefs;
+
+    // The key for each primitive function that can be bound
+    // when the image is loaded. Keys from 'mP' are preferred.
+    // Built when the first primitive is written.
+    map<PrimitiveFunction, string> mPrimitives;
+
+    // False if an object could not be stored
+    bool mOk;
+
+  public:
+    ImageWriter(XY* xy) : mXY(xy), mOk(true) { }
+
+    // Returns the key for the primitive function, or null if it
+    // isn't one the interpreter knows about.
+    string const* primitive(PrimitiveFunction f) {
+      if (mPrimitives.empty()) {
+        PrimitiveTable table;
+        primitive_table(mXY, table);
+        for (PrimitiveTable::iterator it = table.begin(); it != table.end(); ++it) {
+          string const& key = (*it).first;
+          bool method = key.compare(0, METHOD_PRIMITIVE.size(), METHOD_PRIMITIVE) == 0;
+          if (!method || mPrimitives.find((*it).second) == mPrimitives.end())
+            mPrimitives.insert(make_pair((*it).second, key));
+        }
+      }
+
+      map<PrimitiveFunction, string>::iterator it = mPrimitives.find(f);
+      return it == mPrimitives.end() ? 0 : &(*it).second;
+    }
+
+    // Returns the ref for the object, queuing it to be
+    // written if it has not been seen before.
+    uint32_t ref(GCObject* o) {
+      if (!o)
+        return 0;
+
+      map<GCObject*, uint32_t>::iterator it = mRefs.find(o);
+      if (it != mRefs.end())
+        return (*it).second;
+
+      mObjects.push_back(o);
+      uint32_t r = mObjects.size();
+      mRefs[o] = r;
+      return r;
+    }
+
+    void u8(string& out, unsigned char v) {
+      out.push_back(v);
+    }
+
+    void u32(string& out, uint32_t v) {
+      out.append(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+
+    void i32(string& out, int32_t v) {
+      out.append(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+
+    void i64(string& out, int64_t v) {
+      out.append(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+
+    void str(string& out, string const& v) {
+      u32(out, v.size());
+      out.append(v);
+    }
+
+    void ref(string& out, GCObject* o) {
+      u32(out, ref(o));
+    }
+
+    template <class InputIterator>
+    void refs(string& out, InputIterator first, InputIterator last) {
+      u32(out, std::distance(first, last));
+      for (; first != last; ++first)
+        ref(out, *first);
+    }
+
+    // Write the immutable flag and slots common to all objects
+    void object(string& out, XYObject* o) {
+      u8(out, o->mImmutable);
+      XYShape* shape = o->mShape;
+      u32(out, shape->mNames.size());
+      for (XYShape::Offsets::iterator it = shape->mOffsets.begin(); it != shape->mOffsets.end(); ++it) {
+        XYSlot& slot = *o->slotAt((*it).second);
+        str(out, (*it).first);
+        ref(out, slot.mMethod);
+        ref(out, slot.mValue);
+        u8(out, shape->mParent[(*it).second]);
+      }
+    }
+
+    // Append the record for the object to 'out'
+    void record(string& out, GCObject* o) {
+      ImageTag tag;
+      string data;
+      type_info const& type = typeid(*o);
+
+      if (o == empty_list()) {
+        tag = IMAGE_EMPTY_LIST;
+      }
+      else if (type == typeid(XYStreamChunk)) {
+        XYStreamChunk* c = static_cast<XYStreamChunk*>(o);
+        tag = IMAGE_STREAM_CHUNK;
+        ref(data, c->mPredicate);
+        ref(data, c->mValue);
+        ref(data, c->mNext);
+        ref(data, c->mStack);
+        ref(data, c->mSeed);
+        ref(data, c->mNextChunk);
+        refs(data, c->mElements.begin(), c->mElements.end());
+      }
+      else {
+        XYObject* x = dynamic_cast<XYObject*>(o);
+        if (!x) {
+          mOk = false;
+          return;
+        }
+
+        object(data, x);
+        if (type == typeid(XYObject)) {
+          tag = IMAGE_OBJECT;
+        }
+        else if (type == typeid(XYFloat)) {
+          tag = IMAGE_FLOAT;
+          str(data, float_to_string(static_cast<XYFloat*>(o)->mValue));
+        }
+        else if (type == typeid(XYInteger)) {
+          mpz_srcptr value = static_cast<XYInteger*>(o)->mValue.get_mpz_t();
+          size_t limbs = mpz_size(value);
+          tag = IMAGE_INTEGER;
+          i32(data, mpz_sgn(value) < 0 ? -static_cast<int32_t>(limbs) : limbs);
+          data.append(reinterpret_cast<char const*>(mpz_limbs_read(value)),
+                      limbs * sizeof(mp_limb_t));
+        }
+        else if (type == typeid(XYSymbol)) {
+          tag = IMAGE_SYMBOL;
+          str(data, static_cast<XYSymbol*>(o)->mValue);
+        }
+        else if (type == typeid(XYShuffle)) {
+          XYShuffle* s = static_cast<XYShuffle*>(o);
+          tag = IMAGE_SHUFFLE;
+          str(data, s->mBefore);
+          str(data, s->mAfter);
+        }
+        else if (type == typeid(XYString)) {
+          tag = IMAGE_STRING;
+          str(data, static_cast<XYString*>(o)->mValue);
+        }
+        else if (type == typeid(XYList)) {
+          XYList* l = static_cast<XYList*>(o);
+          tag = IMAGE_LIST;
+          refs(data, l->mList.begin(), l->mList.end());
+        }
+        else if (type == typeid(XYSlice)) {
+          XYSlice* s = static_cast<XYSlice*>(o);
+          tag = IMAGE_SLICE;
+          ref(data, s->mOriginal);
+          i64(data, s->mBegin);
+          i64(data, s->mEnd);
+        }
+        else if (type == typeid(XYJoin)) {
+          XYJoin* j = static_cast<XYJoin*>(o);
+          tag = IMAGE_JOIN;
+          refs(data, j->mSequences.begin(), j->mSequences.end());
+        }
+        else if (type == typeid(XYRange)) {
+          XYRange* r = static_cast<XYRange*>(o);
+          tag = IMAGE_RANGE;
+          i64(data, r->mStart);
+          i64(data, r->mStop);
+          i64(data, r->mStep);
+          refs(data, r->mElements.begin(), r->mElements.end());
+        }
+        else if (type == typeid(XYStream)) {
+          XYStream* s = static_cast<XYStream*>(o);
+          tag = IMAGE_STREAM;
+          ref(data, s->mChunk);
+          u32(data, s->mOffset);
+        }
+        else if (type == typeid(XYPrimitive)) {
+          XYPrimitive* p = static_cast<XYPrimitive*>(o);
+          string const* key = primitive(p->mFunc);
+          if (!key) {
+            mOk = false;
+            return;
+          }
+          tag = IMAGE_PRIMITIVE;
+          str(data, *key);
+          str(data, p->mName);
+        }
+        else if (type == typeid(XYDictionary)) {
+          XYDictionary* d = static_cast<XYDictionary*>(o);
+          tag = IMAGE_DICTIONARY;
+          u32(data, d->size());
+          for (XYDictionary::Entries::iterator it = d->mEntries.begin();
+               it != d->mEntries.end();
+               ++it) {
+            if ((*it).mState == XYDictionary::Entry::USED) {
+              ref(data, (*it).mKey);
+              ref(data, (*it).mValue);
+            }
+          }
+        }
+        else if (type == typeid(XYSet)) {
+          XYSet* s = static_cast<XYSet*>(o);
+          tag = IMAGE_SET;
+          refs(data, s->mList.begin(), s->mList.end());
+        }
+        else {
+          // Threads, sockets, iterations in progress, etc.
+          mOk = false;
+          return;
+        }
+      }
+
+      u8(out, tag);
+      u32(out, data.size());
+      out.append(data);
+    }
+
+    // Append the records for every object that has been given a
+    // ref. Returns false if any of them could not be stored.
+    bool records(string& out) {
+      for (size_t i=0; i < mObjects.size() && mOk; ++i)
+        record(out, mObjects[i]);
+      return mOk;
+    }
+};
+
+bool save_image(XY* xy, char const* filename) {
+  ImageWriter writer(xy);
+
+  // The roots are written first, giving refs to the objects they
+  // hold. Writing the records may give refs to more objects, which
+  // are then written in turn.
+  string roots;
+  writer.u32(roots, xy->mEnv.size());
+  for (XYEnv::iterator it = xy->mEnv.begin(); it != xy->mEnv.end(); ++it) {
+    writer.str(roots, (*it).first);
+    writer.ref(roots, (*it).second);
+  }
+  writer.refs(roots, xy->mX.begin(), xy->mX.end());
+  writer.refs(roots, xy->mY.begin(), xy->mY.end());
+  writer.ref(roots, xy->mFrame);
+
+  string records;
+  if (!writer.records(records))
+    return false;
+
+  string header(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  writer.u32(header, IMAGE_VERSION);
+  writer.u32(header, writer.mObjects.size());
+
+  ofstream file(filename, ios::out | ios::binary | ios::trunc);
+  file.write(header.data(), header.size());
+  file.write(roots.data(), roots.size());
+  file.write(records.data(), records.size());
+  file.close();
+  return !file.fail();
+}
+
+// Reads an image that has been mapped into memory. Objects are
+// created in a first pass over the records, then a second pass
+// fixes up the pointers between them using the refs.
+class ImageReader {
+  public:
+    XY* mXY;
+
+    // The unread part of the image
+    char const* mPos;
+    char const* mEnd;
+
+    // False if the image is truncated or invalid
+    bool mOk;
+
+    // The objects in ref order, with the tag and data
+    // for each of their records.
+    vector<GCObject*> mObjects;
+    vector<unsigned char> mTags;
+    vector<char const*> mRecords;
+
+    // Primitives that the image can bind to. Built when the
+    // first primitive is read.
+    PrimitiveTable mPrimitives;
+
+  public:
+    ImageReader(XY* xy, char const* data, size_t size) :
+      mXY(xy),
+      mPos(data),
+      mEnd(data + size),
+      mOk(true) {
+    }
+
+    bool read(void* v, size_t size) {
+      if (!mOk || static_cast<size_t>(mEnd - mPos) < size) {
+        mOk = false;
+        memset(v, 0, size);
+        return false;
+      }
+      memcpy(v, mPos, size);
+      mPos += size;
+      return true;
+    }
+
+    unsigned char u8() {
+      unsigned char v;
+      read(&v, sizeof(v));
+      return v;
+    }
+
+    uint32_t u32() {
+      uint32_t v;
+      read(&v, sizeof(v));
+      return v;
+    }
+
+    int32_t i32() {
+      int32_t v;
+      read(&v, sizeof(v));
+      return v;
+    }
+
+    int64_t i64() {
+      int64_t v;
+      read(&v, sizeof(v));
+      return v;
+    }
+
+    string str() {
+      uint32_t size = u32();
+      if (!mOk || static_cast<size_t>(mEnd - mPos) < size) {
+        mOk = false;
+        return string();
+      }
+      string v(mPos, size);
+      mPos += size;
+      return v;
+    }
+
+    // Read a ref to an object of type T. Only valid once all the
+    // objects have been created.
+    template <class T>
+    T* ref() {
+      uint32_t r = u32();
+      if (r == 0)
+        return 0;
+      if (r > mObjects.size()) {
+        mOk = false;
+        return 0;
+      }
+      T* o = dynamic_cast<T*>(mObjects[r - 1]);
+      if (!o)
+        mOk = false;
+      return o;
+    }
+
+    // Read a count followed by that many refs. None of
+    // them may be null.
+    template <class T, class OutputIterator>
+    void refs(OutputIterator out) {
+      uint32_t count = u32();
+      for (uint32_t i=0; i < count && mOk; ++i) {
+        T* o = ref<T>();
+        if (o)
+          *out++ = o;
+        else
+          mOk = false;
+      }
+    }
+
+    // Skip the immutable flag and slots of an object
+    void skip_object() {
+      u8();
+      uint32_t count = u32();
+      for (uint32_t i=0; i < count && mOk; ++i) {
+        str();
+        u32();
+        u32();
+        u8();
+      }
+    }
+
+    // Read the immutable flag and slots of an object
+    void object(XYObject* o) {
+      o->mImmutable = u8();
+      uint32_t count = u32();
+      for (uint32_t i=0; i < count && mOk; ++i) {
+        string name = str();
+        XYObject* method = ref<XYObject>();
+        XYObject* value = ref<XYObject>();
+        bool parent = u8();
+        if (!mOk || name.empty() || !method || o->getSlot(name)) {
+          mOk = false;
+          return;
+        }
+        o->addSlot(name, method, value, parent);
+      }
+    }
+
+    // Create the object for the record at the current position,
+    // filling in everything but its pointers to other objects.
+    GCObject* create(unsigned char tag) {
+      if (tag == IMAGE_EMPTY_LIST)
+        return empty_list();
+      if (tag == IMAGE_STREAM_CHUNK)
+        return new XYStreamChunk(mXY, 0, 0, 0, 0, 0);
+
+      skip_object();
+      switch (tag) {
+      case IMAGE_OBJECT:
+        return new XYObject();
+
+      case IMAGE_FLOAT: {
+        // A negative base means the exponent is in decimal
+        mpf_class value;
+        if (mpf_set_str(value.get_mpf_t(), str().c_str(), -16) != 0) {
+          mOk = false;
+          return 0;
+        }
+        return new XYFloat(value);
+      }
+
+      case IMAGE_INTEGER: {
+        int32_t size = i32();
+        size_t limbs = size < 0 ? -static_cast<int64_t>(size) : size;
+        if (!mOk || static_cast<size_t>(mEnd - mPos) / sizeof(mp_limb_t) < limbs) {
+          mOk = false;
+          return 0;
+        }
+
+        // The limbs are imported directly from the record
+        XYInteger* i = new XYInteger();
+        mpz_import(i->mValue.get_mpz_t(), limbs, -1, sizeof(mp_limb_t), 0, 0, mPos);
+        if (size < 0)
+          mpz_neg(i->mValue.get_mpz_t(), i->mValue.get_mpz_t());
+        mPos += limbs * sizeof(mp_limb_t);
+        return i;
+      }
+
+      case IMAGE_SYMBOL:
+        return new XYSymbol(str());
+
+      case IMAGE_SHUFFLE: {
+        // Constructed from the pattern so that it is compiled
+        string before = str();
+        string pattern = before + "-" + str();
+        if (!is_shuffle_pattern(pattern)) {
+          mOk = false;
+          return 0;
+        }
+        return new XYShuffle(pattern);
+      }
+
+      case IMAGE_STRING:
+        return new XYString(str());
+
+      case IMAGE_LIST:
+        return new XYList();
+
+      case IMAGE_SLICE:
+        return new XYSlice(0, 0, 0);
+
+      case IMAGE_JOIN:
+        return new XYJoin();
+
+      case IMAGE_RANGE: {
+        int64_t start = i64();
+        int64_t stop = i64();
+        int64_t step = i64();
+        if (step == 0) {
+          mOk = false;
+          return 0;
+        }
+        return new XYRange(start, stop, step);
+      }
+
+      case IMAGE_STREAM: {
+        u32();
+        uint32_t offset = u32();
+        if (offset >= XYStreamChunk::CAPACITY) {
+          mOk = false;
+          return 0;
+        }
+        return new XYStream(0, offset);
+      }
+
+      case IMAGE_PRIMITIVE: {
+        string key = str();
+        string name = str();
+        if (mPrimitives.empty())
+          primitive_table(mXY, mPrimitives);
+        PrimitiveTable::iterator it = mPrimitives.find(key);
+        if (it == mPrimitives.end()) {
+          mOk = false;
+          return 0;
+        }
+
+        // Share the interpreter's own primitive object if it has one
+        XYEnv::iterator pit = mXY->mP.find(key);
+        XYPrimitive* p = pit != mXY->mP.end() ? dynamic_cast<XYPrimitive*>((*pit).second) : 0;
+        if (p && p->mFunc == (*it).second && p->mName == name)
+          return p;
+        return new XYPrimitive(name, (*it).second);
+      }
+
+      case IMAGE_DICTIONARY:
+        return new XYDictionary();
+
+      case IMAGE_SET:
+        return new XYSet();
+
+      default:
+        mOk = false;
+        return 0;
+      }
+    }
+
+    // Set the pointers of the object for the record at the
+    // current position.
+    void fixup(unsigned char tag, GCObject* o) {
+      if (tag == IMAGE_EMPTY_LIST)
+        return;
+
+      if (tag == IMAGE_STREAM_CHUNK) {
+        XYStreamChunk* c = static_cast<XYStreamChunk*>(o);
+        c->mPredicate = ref<XYSequence>();
+        c->mValue = ref<XYSequence>();
+        c->mNext = ref<XYSequence>();
+        c->mStack = ref<XYList>();
+        c->mSeed = ref<XYObject>();
+        c->mNextChunk = ref<XYStreamChunk>();
+        refs<XYObject>(back_inserter(c->mElements));
+        if (!c->mPredicate || !c->mValue || !c->mNext || !c->mStack ||
+            c->mElements.size() > XYStreamChunk::CAPACITY)
+          mOk = false;
+        return;
+      }
+
+      object(static_cast<XYObject*>(o));
+      switch (tag) {
+      case IMAGE_LIST:
+        refs<XYObject>(back_inserter(static_cast<XYList*>(o)->mList));
+        break;
+
+      case IMAGE_SLICE: {
+        // The bounds are checked by 'views' once every object is
+        // complete.
+        XYSlice* s = static_cast<XYSlice*>(o);
+        s->mOriginal = ref<XYSequence>();
+        int64_t begin = i64();
+        int64_t end = i64();
+        s->mBegin = begin;
+        s->mEnd = end;
+        if (mOk && (!s->mOriginal || begin < 0 || begin > end || end > INT_MAX))
+          mOk = false;
+        break;
+      }
+
+      case IMAGE_JOIN:
+        refs<XYSequence>(back_inserter(static_cast<XYJoin*>(o)->mSequences));
+        break;
+
+      case IMAGE_RANGE:
+        i64();
+        i64();
+        i64();
+        refs<XYObject>(back_inserter(static_cast<XYRange*>(o)->mElements));
+        break;
+
+      case IMAGE_STREAM: {
+        XYStream* s = static_cast<XYStream*>(o);
+        s->mChunk = ref<XYStreamChunk>();
+        u32();
+        if (!s->mChunk)
+          mOk = false;
+        break;
+      }
+
+      case IMAGE_SET:
+        // Indexed by 'fill' since that hashes the elements
+        refs<XYObject>(back_inserter(static_cast<XYSet*>(o)->mList));
+        break;
+
+      default:
+        // Remaining objects have no pointers apart from their slots.
+        // Dictionaries are filled once every object is complete
+        // since adding to them hashes their keys.
+        break;
+      }
+    }
+
+    // Append the objects that the slice, join, stream or stream
+    // chunk 'o' gets its elements from.
+    static void viewed(GCObject* o, vector<GCObject*>& out) {
+      if (XYSlice* s = dynamic_cast<XYSlice*>(o))
+        out.push_back(s->mOriginal);
+      else if (XYJoin* j = dynamic_cast<XYJoin*>(o))
+        out.insert(out.end(), j->mSequences.begin(), j->mSequences.end());
+      else if (XYStream* s = dynamic_cast<XYStream*>(o))
+        out.push_back(s->mChunk);
+      else if (XYStreamChunk* c = dynamic_cast<XYStreamChunk*>(o)) {
+        if (c->mNextChunk)
+          out.push_back(c->mNextChunk);
+      }
+    }
+
+    // The number of elements of 'seq' that can be read without
+    // computing any more of a stream.
+    static size_t available(XYSequence* seq) {
+      if (XYSlice* s = dynamic_cast<XYSlice*>(seq))
+        return s->mEnd - s->mBegin;
+
+      if (XYJoin* j = dynamic_cast<XYJoin*>(seq)) {
+        size_t n = 0;
+        for (XYJoin::iterator it = j->mSequences.begin(); it != j->mSequences.end(); ++it)
+          n += available(*it);
+        return n;
+      }
+
+      if (XYStream* s = dynamic_cast<XYStream*>(seq)) {
+        size_t n = 0;
+        size_t start = s->mOffset;
+        for (XYStreamChunk* c = s->mChunk; c && start <= c->mElements.size(); c = c->mNextChunk) {
+          n += c->mElements.size() - start;
+          if (c->mElements.size() < XYStreamChunk::CAPACITY)
+            break;
+          start = 0;
+        }
+        return n;
+      }
+
+      return seq->size();
+    }
+
+    // Check that no slice, join or stream gets its elements from
+    // itself, and that slices are within their original sequence.
+    // Reading an element would otherwise never finish or read
+    // outside the original. Refs can point at later records, so
+    // this is done once all the pointers are set.
+    bool views() {
+      map<GCObject*, size_t> index;
+      for (size_t i=0; i < mObjects.size(); ++i)
+        index[mObjects[i]] = i;
+
+      // Depth first search, without recursion as a stream can have
+      // a long chain of chunks. Objects are NEW until visited, then
+      // ACTIVE while the objects they view are searched.
+      enum { NEW, ACTIVE, DONE };
+      vector<unsigned char> state(mObjects.size(), NEW);
+      vector<pair<size_t, vector<GCObject*> > > path;
+      for (size_t i=0; i < mObjects.size(); ++i) {
+        if (state[i] != NEW)
+          continue;
+
+        state[i] = ACTIVE;
+        path.push_back(make_pair(i, vector<GCObject*>()));
+        viewed(mObjects[i], path.back().second);
+        while (!path.empty()) {
+          vector<GCObject*>& next = path.back().second;
+          if (next.empty()) {
+            state[path.back().first] = DONE;
+            path.pop_back();
+            continue;
+          }
+
+          size_t n = index[next.back()];
+          next.pop_back();
+          if (state[n] == ACTIVE)
+            return false;
+          if (state[n] == NEW) {
+            state[n] = ACTIVE;
+            path.push_back(make_pair(n, vector<GCObject*>()));
+            viewed(mObjects[n], path.back().second);
+          }
+        }
+      }
+
+      for (size_t i=0; i < mObjects.size(); ++i) {
+        XYSlice* s = mTags[i] == IMAGE_SLICE ? static_cast<XYSlice*>(mObjects[i]) : 0;
+        if (s && static_cast<size_t>(s->mEnd) > available(s->mOriginal))
+          return false;
+      }
+      return true;
+    }
+
+    // Index the elements of a set or add the entries of a dictionary
+    void fill(unsigned char tag, GCObject* o) {
+      if (tag == IMAGE_SET) {
+        // A set written by 'serialize' has no duplicate elements
+        XYSet* s = static_cast<XYSet*>(o);
+        XYSequence::List elements;
+        elements.swap(s->mList);
+        for (size_t i=0; i < elements.size(); ++i)
+          s->insert(elements[i]);
+        if (s->mList.size() != elements.size())
+          mOk = false;
+        return;
+      }
+
+      object(static_cast<XYObject*>(o));
+      XYDictionary* d = static_cast<XYDictionary*>(o);
+      uint32_t count = u32();
+      for (uint32_t i=0; i < count && mOk; ++i) {
+        XYObject* key = ref<XYObject>();
+        XYObject* value = ref<XYObject>();
+        if (key && value)
+          d->put(key, value);
+        else
+          mOk = false;
+      }
+    }
+
+    // Read the magic number and version
+    bool header(char const* expected) {
+      char magic[sizeof(IMAGE_MAGIC)];
+      return read(magic, sizeof(magic)) &&
+        memcmp(magic, expected, sizeof(magic)) == 0 &&
+        u32() == IMAGE_VERSION;
+    }
+
+    // Create the objects for the 'count' records at the current
+    // position and connect them together.
+    bool objects(uint32_t count) {
+      for (uint32_t i=0; i < count && mOk; ++i) {
+        unsigned char tag = u8();
+        uint32_t size = u32();
+        if (!mOk || static_cast<size_t>(mEnd - mPos) < size)
+          return false;
+
+        char const* next = mPos + size;
+        mTags.push_back(tag);
+        mRecords.push_back(mPos);
+        mObjects.push_back(create(tag));
+        mPos = next;
+      }
+
+      // Fix up the pointers
+      for (size_t i=0; i < mObjects.size() && mOk; ++i) {
+        mPos = mRecords[i];
+        if (mTags[i] != IMAGE_DICTIONARY)
+          fixup(mTags[i], mObjects[i]);
+      }
+      if (!mOk || !views())
+        return false;
+
+      // Sets first, as a dictionary key can be a slice of one
+      for (size_t i=0; i < mObjects.size() && mOk; ++i) {
+        if (mTags[i] == IMAGE_SET)
+          fill(mTags[i], mObjects[i]);
+      }
+      for (size_t i=0; i < mObjects.size() && mOk; ++i) {
+        mPos = mRecords[i];
+        if (mTags[i] == IMAGE_DICTIONARY)
+          fill(mTags[i], mObjects[i]);
+      }
+      return mOk;
+    }
+
+    bool load() {
+      if (!header(IMAGE_MAGIC))
+        return false;
+
+      uint32_t count = u32();
+
+      // The roots are read once the objects exist
+      char const* roots = mPos;
+      uint32_t env = u32();
+      for (uint32_t i=0; i < env && mOk; ++i) {
+        str();
+        u32();
+      }
+      for (uint32_t i=0; i < 2 && mOk; ++i) {
+        uint32_t items = u32();
+        for (uint32_t j=0; j < items && mOk; ++j)
+          u32();
+      }
+      u32();
+
+      if (!objects(count))
+        return false;
+
+      // Read the roots
+      mPos = roots;
+      XYEnv newEnv;
+      env = u32();
+      for (uint32_t i=0; i < env && mOk; ++i) {
+        string name = str();
+        newEnv[name] = ref<XYObject>();
+      }
+      XYStack newX;
+      refs<XYObject>(back_inserter(newX));
+      XYQueue newY;
+      refs<XYObject>(back_inserter(newY));
+      XYObject* frame = ref<XYObject>();
+
+      if (!mOk)
+        return false;
+
+      mXY->mEnv.swap(newEnv);
+      mXY->mX.swap(newX);
+      mXY->mY.swap(newY);
+      mXY->mFrame = frame;
+
+      // Give the words in the image the native code they would
+      // have had if they were loaded from source.
+      for (XYEnv::iterator it = mXY->mEnv.begin(); it != mXY->mEnv.end(); ++it)
+        attach_native(mXY, (*it).first, (*it).second);
+      return true;
+    }
+
+    // Read a serialized value, returning null if it is invalid
+    XYObject* value() {
+      if (!header(VALUE_MAGIC))
+        return 0;
+
+      uint32_t count = u32();
+      char const* root = mPos;
+      u32();
+
+      if (!objects(count))
+        return 0;
+
+      mPos = root;
+      XYObject* result = ref<XYObject>();
+      return mOk ? result : 0;
+    }
+};
+
+bool load_image(XY* xy, char const* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  ImageReader reader(xy, static_cast<char const*>(data), size);
+  bool result = reader.load();
+  munmap(data, size);
+  return result;
+}
+
+bool serialize(XY* xy, XYObject* o, string& out) {
+  ImageWriter writer(xy);
+  string value;
+  writer.ref(value, o);
+
+  string records;
+  if (!writer.records(records))
+    return false;
+
+  out.assign(VALUE_MAGIC, sizeof(VALUE_MAGIC));
+  writer.u32(out, IMAGE_VERSION);
+  writer.u32(out, writer.mObjects.size());
+  out.append(value);
+  out.append(records);
+  return true;
+}
+
+XYObject* deserialize(XY* xy, char const* data, size_t size) {
+  ImageReader reader(xy, data, size);
+  return reader.value();
+}
+
+// serialize [X^o Y] -> [X^string Y]
+// Encodes an object, and everything reachable from it, as a string
+// of bytes that 'deserialize' turns back into a copy of the object.
+static void primitive_serialize(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYObject* o(xy->mX.back());
+
+  XYString* s(new XYString(""));
+  xy_assert(serialize(xy, o, s->mValue), XYError::TYPE);
+  xy->mX.pop_back();
+  xy->mX.push_back(s);
+}
+
+// deserialize [X^string Y] -> [X^o Y]
+static void primitive_deserialize(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYString* s(dynamic_cast<XYString*>(xy->mX.back()));
+  xy_assert(s, XYError::TYPE);
+
+  // Decoded in place from the string's bytes
+  XYObject* o = deserialize(xy, s->mValue.data(), s->mValue.size());
+  xy_assert(o, XYError::TYPE);
+  xy->mX.pop_back();
+  xy->mX.push_back(o);
+}
+
+void install_image_primitives(XY* xy) {
+  xy->mP["serialize"] = new XYPrimitive("serialize", primitive_serialize);
+  xy->mP["deserialize"] = new XYPrimitive("deserialize", primitive_deserialize);
+}
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// The original author of this code can be contacted at: chris.double@double.co.nz
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// DEVELOPERS AND CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
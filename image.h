@@ -0,0 +1,63 @@
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// See the license at the end of this file
+#if !defined(image_h)
+#define image_h
+
+#include "cf.h"
+
+// An image is a binary snapshot of an interpreter: its environment,
+// stack, queue and current frame along with every object reachable
+// from them. Loading an image restores that state without having to
+// evaluate the source files that produced it.
+//
+// Primitives are stored by name and are bound to the primitives of
+// the interpreter loading the image, so an image can only be loaded
+// by an interpreter that has the same primitives installed.
+
+// Write the state of the interpreter to the image file. Returns false
+// if the file can't be written or the state holds objects that can't
+// be stored in an image, like threads and sockets.
+bool save_image(XY* xy, char const* filename);
+
+// Replace the state of the interpreter with that stored in the image
+// file. Returns false, leaving the interpreter unchanged, if the file
+// can't be read or is not a valid image.
+bool load_image(XY* xy, char const* filename);
+
+// Encode the object and every object reachable from it into 'out'
+// using the same records as an image. Sharing and cycles between the
+// objects are preserved. Returns false if any of them can't be stored.
+bool serialize(XY* xy, XYObject* o, std::string& out);
+
+// Decode a value written by 'serialize', reading directly from the
+// given bytes. Returns null if they are not a valid serialized value.
+XYObject* deserialize(XY* xy, char const* data, size_t size);
+
+// Add the 'serialize' and 'deserialize' primitives
+void install_image_primitives(XY* xy);
+
+#endif // image_h
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// The original author of this code can be contacted at: chris.double@double.co.nz
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// DEVELOPERS AND CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
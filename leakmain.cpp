@@ -15,62 +15,8 @@
 using namespace std;
 using namespace boost;
 
-// A literate file. See literate.lcf for details.
-void eval_literate_file(XY* xy, const char* filename) {
-  cout << "Loading " << filename << endl;
-  ifstream file(filename);
-  ostringstream out;
-  while (file.good()) {
-    string line;
-    getline(file, line);
-
-    // Evaluate the Bird style of code
-    if (line.size() > 0 && line[0] == '>') {
-      out << line.substr(1) << endl;
-    }
-
-    if (line == "\\begin{code}") {
-      // Evaluate the LaTeX style of code
-      while (file.good()) {
-	getline(file, line);
-	if (line == "\\end{code}")
-	  break;
-
-	out << line << endl;
-      }
-    }
-  }
-  file.close();
-
-  parse(out.str(), back_inserter(xy->mY));
-
-  xy->eval();
-}
-
-void eval_non_literate_file(XY* xy, const char* filename) {
-  cout << "Loading " << filename << endl;
-  ifstream file(filename);
-  ostringstream out;
-  while (file.good()) {
-    string line;
-    getline(file, line);
-    out << line << endl;
-  }
-  file.close();
-
-  parse(out.str(), back_inserter(xy->mY));
-
-  xy->eval();
-}
-
-void eval_file(XY* xy, const char* fn) {
-  char* filename = strdup(fn);
-  char* ext = strrchr(filename, '.');
-  if (ext && strcmp(ext, ".lcf") == 0)
-    eval_literate_file(xy, filename);
-  else
-    eval_non_literate_file(xy, filename);
-  free(filename);
+void eval_file(XY* xy, const char* filename) {
+  load_file(xy, filename);
   GarbageCollector::GC.collect();
 }
 
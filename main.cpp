@@ -10,90 +10,82 @@
 #include "cf.h"
 #include "socket.h"
 #include "threads.h"
+#include "image.h"
 
 using namespace std;
 using namespace boost;
 
-// A literate file. See literate.lcf for details.
-void eval_literate_file(XY* xy, char* filename) {
-  cout << "Loading " << filename << endl;
-  ifstream file(filename);
-  ostringstream out;
-  while (file.good()) {
-    string line;
-    getline(file, line);
-
-    // Evaluate the Bird style of code
-    if (line.size() > 0 && line[0] == '>') {
-      out << line.substr(1) << endl;
-    }
-
-    if (line == "\\begin{code}") {
-      // Evaluate the LaTeX style of code
-      while (file.good()) {
-	getline(file, line);
-	if (line == "\\end{code}")
-	  break;
-
-	out << line << endl;
-      }
-    }
-  }
-  file.close();
-
-  parse(out.str(), back_inserter(xy->mY));
-
-  xy->eval();
-}
-
-void eval_non_literate_file(XY* xy, char* filename) {
-  cout << "Loading " << filename << endl;
-  ifstream file(filename);
-  ostringstream out;
-  while (file.good()) {
-    string line;
-    getline(file, line);
-    out << line << endl;
-  }
-  file.close();
-
-  parse(out.str(), back_inserter(xy->mY));
-
-  xy->eval();
-}
-
-void eval_file(XY* xy, char* filename) {
-  char* ext = strrchr(filename, '.');
-  if (ext && strcmp(ext, ".lcf") == 0)
-    eval_literate_file(xy, filename);
-  else
-    eval_non_literate_file(xy, filename);
-}
+// Defined in prelude_cfc.cpp, which cfc generates from prelude.cf
+void install_prelude_primitives(XY* xy);
 
 template <class InputIterator>
 void eval_files(XY* xy, InputIterator first, InputIterator last) {
   for(InputIterator it = first; it != last; ++it)
-    eval_file(xy, *it);
+    load_file(xy, *it);
 }
 
 int main(int argc, char* argv[]) {
   boost::asio::io_service io;
 
+  // Options are:
+  //   --image file       Start from the state saved in the image file
+  //   --save-image file  Save the state to the image file after loading
+  //                      the other files given, then exit.
+  //   --hash-cons        Share structurally equal literals in parsed
+  //                      programs. They are copied on write.
+  // Any other arguments are files to load.
+  char* image = 0;
+  char* saveImage = 0;
+  bool hashCons = false;
+  vector<char*> files;
+  for (int i=1; i < argc; ++i) {
+    if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+      image = argv[++i];
+    else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc)
+      saveImage = argv[++i];
+    else if (strcmp(argv[i], "--hash-cons") == 0)
+      hashCons = true;
+    else
+      files.push_back(argv[i]);
+  }
+
   XY* xy(new XY(io));
   install_socket_primitives(xy);
   install_thread_primitives(xy);
+  install_image_primitives(xy);
+  install_prelude_primitives(xy);
+  if (hashCons)
+    xy->mInterner = new XYInterner(65536);
+
+  if (image) {
+    cout << "Loading image " << image << endl;
+    if (!load_image(xy, image)) {
+      cout << "Unable to load image " << image << endl;
+      return 1;
+    }
+  }
 
-  if (argc > 1) {
+  if (files.size() > 0) {
     // Load all files given on the command line in order
     try {
-      eval_files(xy, argv + 1, argv + argc);
+      eval_files(xy, files.begin(), files.end());
     }
     catch(XYError& error) {
       cout << error.message() << endl;
+      if (saveImage)
+        return 1;
       xy = new XY(io);
     }
   }
 
+  if (saveImage) {
+    if (!save_image(xy, saveImage)) {
+      cout << "Unable to save image " << saveImage << endl;
+      return 1;
+    }
+    return 0;
+  }
+
   // Limit test. If any line input by the user takes
   // longer than this time period to run then a
   // limit exception is thrown.
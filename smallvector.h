@@ -0,0 +1,221 @@
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// See the license at the end of this file
+#if !defined(smallvector_h)
+#define smallvector_h
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <iterator>
+#include <algorithm>
+
+// A vector that stores up to N elements inline and only allocates
+// heap storage when it grows beyond that. Most lists created by the
+// interpreter are short, so this avoids an allocation per list. The
+// element type must be trivially copyable (it is used for pointers)
+// as elements are moved with memcpy.
+template <class T, size_t N>
+class SmallVector
+{
+  public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef T const& const_reference;
+    typedef T* pointer;
+    typedef T const* const_pointer;
+    typedef T* iterator;
+    typedef T const* const_iterator;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+  private:
+    T* mData;
+    size_type mSize;
+    size_type mCapacity;
+    T mInline[N];
+
+  public:
+    SmallVector() : mData(mInline), mSize(0), mCapacity(N) { }
+
+    SmallVector(SmallVector const& rhs) : mData(mInline), mSize(0), mCapacity(N) {
+      assign(rhs.begin(), rhs.end());
+    }
+
+    template <class InputIterator>
+    SmallVector(InputIterator first, InputIterator last) : mData(mInline), mSize(0), mCapacity(N) {
+      assign(first, last);
+    }
+
+    ~SmallVector() {
+      if (!isInline())
+        free(mData);
+    }
+
+    SmallVector& operator=(SmallVector const& rhs) {
+      if (this != &rhs)
+        assign(rhs.begin(), rhs.end());
+      return *this;
+    }
+
+    iterator begin() { return mData; }
+    iterator end() { return mData + mSize; }
+    const_iterator begin() const { return mData; }
+    const_iterator end() const { return mData + mSize; }
+
+    size_type size() const { return mSize; }
+    size_type capacity() const { return mCapacity; }
+    bool empty() const { return mSize == 0; }
+
+    reference operator[](size_type n) { return mData[n]; }
+    const_reference operator[](size_type n) const { return mData[n]; }
+    reference front() { return mData[0]; }
+    const_reference front() const { return mData[0]; }
+    reference back() { return mData[mSize - 1]; }
+    const_reference back() const { return mData[mSize - 1]; }
+
+    void reserve(size_type n) {
+      if (n <= mCapacity)
+        return;
+
+      T* data = static_cast<T*>(malloc(n * sizeof(T)));
+      assert(data);
+      memcpy(data, mData, mSize * sizeof(T));
+      if (!isInline())
+        free(mData);
+      mData = data;
+      mCapacity = n;
+    }
+
+    void resize(size_type n, T const& v = T()) {
+      reserve(n);
+      for (size_type i = mSize; i < n; ++i)
+        mData[i] = v;
+      mSize = n;
+    }
+
+    void clear() { mSize = 0; }
+
+    void push_back(T const& v) {
+      if (mSize == mCapacity) {
+        // 'v' may refer to an element of this vector
+        T copy(v);
+        grow(mSize + 1);
+        mData[mSize++] = copy;
+      }
+      else
+        mData[mSize++] = v;
+    }
+
+    void pop_back() {
+      assert(mSize > 0);
+      --mSize;
+    }
+
+    iterator insert(iterator pos, T const& v) {
+      return insert(pos, &v, &v + 1);
+    }
+
+    template <class InputIterator>
+    iterator insert(iterator pos, InputIterator first, InputIterator last) {
+      // Copy the new elements first as they may come from this vector
+      // or be single pass iterators.
+      SmallVector items;
+      for (; first != last; ++first)
+        items.push_back(*first);
+
+      size_type index = pos - mData;
+      size_type count = items.size();
+      grow(mSize + count);
+      memmove(mData + index + count, mData + index, (mSize - index) * sizeof(T));
+      memcpy(mData + index, items.mData, count * sizeof(T));
+      mSize += count;
+      return mData + index;
+    }
+
+    iterator erase(iterator pos) {
+      return erase(pos, pos + 1);
+    }
+
+    iterator erase(iterator first, iterator last) {
+      memmove(first, last, (end() - last) * sizeof(T));
+      mSize -= last - first;
+      return first;
+    }
+
+    template <class InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+      clear();
+      for (; first != last; ++first)
+        push_back(*first);
+    }
+
+    void swap(SmallVector& rhs) {
+      if (!isInline() && !rhs.isInline()) {
+        std::swap(mData, rhs.mData);
+        std::swap(mSize, rhs.mSize);
+        std::swap(mCapacity, rhs.mCapacity);
+        return;
+      }
+
+      SmallVector temp;
+      temp.take(*this);
+      take(rhs);
+      rhs.take(temp);
+    }
+
+  private:
+    bool isInline() const { return mData == mInline; }
+
+    // Ensure there is room for 'n' elements, at least doubling
+    // the capacity when it has to grow.
+    void grow(size_type n) {
+      if (n > mCapacity)
+        reserve(std::max(n, mCapacity * 2));
+    }
+
+    // Move the contents of 'rhs' into this vector, which
+    // must not own heap storage. Leaves 'rhs' empty.
+    void take(SmallVector& rhs) {
+      assert(isInline());
+      if (rhs.isInline()) {
+        memcpy(mInline, rhs.mInline, rhs.mSize * sizeof(T));
+        mData = mInline;
+        mCapacity = N;
+      }
+      else {
+        mData = rhs.mData;
+        mCapacity = rhs.mCapacity;
+        rhs.mData = rhs.mInline;
+        rhs.mCapacity = N;
+      }
+      mSize = rhs.mSize;
+      rhs.mSize = 0;
+    }
+};
+
+#endif // smallvector_h
+// Copyright (C) 2009 Chris Double. All Rights Reserved.
+// The original author of this code can be contacted at: chris.double@double.co.nz
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// DEVELOPERS AND CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
@@ -1,6 +1,7 @@
 // Copyright (C) 2009 Chris Double. All Rights Reserved.
 // See the license at the end of this file
 #include <cassert>
+#include <cstdio>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -15,11 +16,33 @@
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/test/minimal.hpp>
 #include "cf.h"
+#include "image.h"
 
 using namespace std;
 using namespace boost;
 using namespace boost::lambda;
 
+// The code cfc generates for '[ 1 + ] inc set' and '[ 1 + inc . ] inc2 set'
+static void native_inc(XYNativeFrame& f) {
+  f.push(0);
+  f.primitive(1);
+}
+
+static void native_inc2(XYNativeFrame& f) {
+  f.push(0);
+  if (!f.primitive(1)) return;
+  f.call(2);
+}
+
+// The elements of a SmallVector as a space separated string
+template <class V>
+static string elements(V const& v) {
+  ostringstream s;
+  for (typename V::const_iterator it = v.begin(); it != v.end(); ++it)
+    s << (it == v.begin() ? "" : " ") << *it;
+  return s.str();
+}
+
 void testParse(boost::asio::io_service& io) 
 {
   {
@@ -364,6 +387,15 @@ void testParse(boost::asio::io_service& io)
     XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
     BOOST_CHECK(n1->toString(true) == "[ [ 1 2 ] [ 1 2 2 ] [ 2 1 2 ] [ 1 2 3 4 ] ]");
   }
+  {
+    // Join test 2
+    // Joining onto an existing join must not modify it.
+    XY* xy(new XY(io));
+    parse("[1] [2], a set a; [3], a; [4] [5], , a;", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 1 2 3 ] [ 1 2 4 5 ] [ 1 2 ] ]");
+  }
   {
     // stackqueue test 1
     XY* xy(new XY(io));
@@ -388,6 +420,623 @@ void testParse(boost::asio::io_service& io)
     XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
     BOOST_CHECK(n1->toString(true) == "[ 3 0 1 3 0 ]");
   }
+  {
+    // pmap, pfilter and peach test 1
+    XY* xy(new XY(io));
+    parse("[1 2 3] [2 *] pmap [1 2 3 4] [3 <] pfilter 0 [1 2 3] [abc-acb [+]`] peach [] [1 +] pmap", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 2 4 6 ] [ 1 2 ] 6 [ ] ]");
+  }
+  {
+    // pmap, pfilter and peach test 2
+    // They match the prelude definitions of 'map', 'filter' and 'each'
+    // they replaced, including what the quotation sees on the stack.
+    char const* prelude =
+      "[a-] drop set [a-aa] dup set [ab-ba] swap set [ puncons ] uncons set "
+      "[ [[a b] [a]b,] (] cons set [''`] unit set [unit.cons.] pair set [[dup.]`] dupd set "
+      "[pair.[dupd.]`[.not]`@.] cond set "
+      "[unit.cons.dup.[uncons.uncons.drop.]`[while.],,[]cond.] while set "
+      "[[[]]`swap;unit.`,uncons;unit.`,while.drop.] each0 set "
+      "[ [[s p] s [] [dup.p.[swap.cons.][drop.]if] foldl|] ( ] filter0 set "
+      "[ [[s q] s [] [q.swap.cons.] foldl|] ( ] map0 set "
+      "[ peach ] each1 set [ pfilter ] filter1 set [ pmap ] map1 set ";
+    char const* programs[] = {
+      "[1 2 3] [2 *] map",
+      "[] [2 *] map",
+      "\"abc\" [1 +] map",
+      "[[1 2] [3]] [ [10 *] map. ] map",
+      "[1 2 3] [ ab-aba count + ] map",
+      "[1 2 3] [ abc-abca count + ] map",
+      "[1 2 3] [ 2 * [] abcd-dbc ] map",
+      "[1 2 3] [ ab-b [10 20] ab-ba ] map",
+      "[1 2 3] [ ab-b 7 ab-ba ] map",
+      "[1 2 3 4] [3 <] filter",
+      "[] [3 <] filter",
+      "[5 1 4 0] [ abcd-abcda count < ] filter",
+      "[1 2 3] [ abcd-ad [0] abc-acb a-aa 2 < ] filter",
+      "[1 2 3] [ abcd-ad [] abc-acb a-aa 2 < ] filter",
+      "0 [1 2 3] [ abc-acb [+]` ] each",
+      "0 [1 2 3] [ ab-aba count + abc-acb [+]` ] each",
+      "0 [1 2 3] [ abc-acb [+]` drop. [] ] each",
+      "0 [1 2 3 4 5 6] [ abc-acb [+]` uncons. ab-b ] each",
+      "[] [ drop. 1 ] each",
+      0
+    };
+    for (char const** program = programs; *program; ++program) {
+      string results[2];
+      for (int i=0; i < 2; ++i) {
+        XY* xy(new XY(io));
+        parse(prelude, back_inserter(xy->mY));
+        xy->eval();
+
+        string code(*program);
+        code += i == 0 ? "0." : "1.";
+        try {
+          parse(code, back_inserter(xy->mY));
+          xy->eval();
+          results[i] = (new XYList(xy->mX.begin(), xy->mX.end()))->toString(true);
+        }
+        catch (XYError& e) {
+          results[i] = "error";
+        }
+      }
+      if (results[0] != results[1])
+        cout << *program << ": " << results[0] << " " << results[1] << endl;
+      BOOST_CHECK(results[0] == results[1]);
+    }
+  }
+  {
+    // Dictionary test 1
+    XYDictionary* d(new XYDictionary());
+    for (int i=0; i < 100; ++i)
+      d->put(new XYInteger(i), new XYInteger(i * 2));
+    d->put(new XYString("abc"), new XYSymbol("abc"));
+    BOOST_CHECK(d->size() == 101);
+    BOOST_CHECK(d->get(new XYInteger(50))->toString(true) == "100");
+    BOOST_CHECK(d->get(new XYFloat(50.0))->toString(true) == "100");
+    BOOST_CHECK(d->get(new XYString("abc"))->toString(true) == "abc");
+    BOOST_CHECK(d->get(new XYInteger(100)) == 0);
+    for (int i=0; i < 50; ++i)
+      BOOST_CHECK(d->remove(new XYInteger(i)));
+    BOOST_CHECK(!d->remove(new XYInteger(0)));
+    BOOST_CHECK(d->size() == 51);
+    BOOST_CHECK(d->get(new XYInteger(99))->toString(true) == "198");
+  }
+  {
+    // Dictionary test 2
+    XY* xy(new XY(io));
+    parse("dict 1 [a b] dict-put 2 foo dict-put 3 foo dict-put [a b] dict-remove a-aa dict-size ab-ba foo dict-get", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 1 3 ]");
+  }
+  {
+    // sort and sort-by test 1
+    XY* xy(new XY(io));
+    parse("[3 -1 2.5 0] sort \"hello\" sort [[2 b] [1 a] [2 a]] [0 ab-ba @] sort-by", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ -1 0 2.5 3 ] \"ehllo\" [ [ 1 a ] [ 2 b ] [ 2 a ] ] ]");
+  }
+  {
+    // Objects of different types are ordered by type rank
+    XY* xy(new XY(io));
+    parse("[foo [1] \"b\" 2 bar 1.5 \"a\"] sort 1 foo < \"a\" [97] =", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 1.5 2 \"a\" \"b\" bar foo [ 1 ] ] 1 0 ]");
+  }
+  {
+    // SmallVector test 1
+    // Growing from inline to heap storage
+    SmallVector<int, 4> v;
+    BOOST_CHECK(v.empty() && v.capacity() == 4);
+    for (int i = 0; i < 4; ++i)
+      v.push_back(i);
+    BOOST_CHECK(v.capacity() == 4);
+    v.push_back(4);
+    BOOST_CHECK(v.capacity() >= 5);
+    BOOST_CHECK(elements(v) == "0 1 2 3 4");
+    for (int i = 5; i < 100; ++i)
+      v.push_back(i);
+    BOOST_CHECK(v.size() == 100 && v.front() == 0 && v.back() == 99);
+
+    // Pushing an element of the vector itself while it grows
+    SmallVector<int, 4> w(v.begin(), v.begin() + 4);
+    w.push_back(w[1]);
+    BOOST_CHECK(elements(w) == "0 1 2 3 1");
+
+    SmallVector<int, 4> r;
+    r.resize(6, 7);
+    BOOST_CHECK(elements(r) == "7 7 7 7 7 7");
+    r.pop_back();
+    r.clear();
+    BOOST_CHECK(r.empty() && r.capacity() >= 6);
+  }
+  {
+    // SmallVector test 2
+    // Insert and erase across the inline/heap boundary
+    SmallVector<int, 4> v;
+    v.push_back(1);
+    v.push_back(4);
+    int items[] = { 2, 3 };
+    v.insert(v.begin() + 1, items, items + 2);
+    BOOST_CHECK(v.capacity() == 4);
+    BOOST_CHECK(elements(v) == "1 2 3 4");
+
+    SmallVector<int, 4>::iterator it = v.insert(v.begin(), 0);
+    BOOST_CHECK(it == v.begin() && *it == 0);
+    BOOST_CHECK(v.capacity() > 4);
+    BOOST_CHECK(elements(v) == "0 1 2 3 4");
+    v.insert(v.end(), 5);
+    BOOST_CHECK(elements(v) == "0 1 2 3 4 5");
+
+    it = v.erase(v.begin() + 1, v.begin() + 4);
+    BOOST_CHECK(*it == 4);
+    BOOST_CHECK(elements(v) == "0 4 5");
+    v.erase(v.begin());
+    v.erase(v.end() - 1);
+    BOOST_CHECK(elements(v) == "4");
+    v.erase(v.begin(), v.end());
+    BOOST_CHECK(v.empty());
+    v.insert(v.begin(), items, items + 2);
+    BOOST_CHECK(elements(v) == "2 3");
+  }
+  {
+    // SmallVector test 3
+    // Copy and assignment between inline and heap storage
+    SmallVector<int, 4> small;
+    small.push_back(1);
+    small.push_back(2);
+    SmallVector<int, 4> large;
+    for (int i = 0; i < 10; ++i)
+      large.push_back(i);
+
+    SmallVector<int, 4> a(small);
+    SmallVector<int, 4> b(large);
+    BOOST_CHECK(elements(a) == "1 2" && a.capacity() == 4);
+    BOOST_CHECK(elements(b) == "0 1 2 3 4 5 6 7 8 9");
+    b[0] = 42;
+    BOOST_CHECK(large[0] == 0);
+
+    // Heap to inline and inline to heap
+    a = large;
+    BOOST_CHECK(elements(a) == "0 1 2 3 4 5 6 7 8 9");
+    b = small;
+    BOOST_CHECK(elements(b) == "1 2");
+    b = b;
+    BOOST_CHECK(elements(b) == "1 2");
+
+    a.swap(b);
+    BOOST_CHECK(elements(a) == "1 2");
+    BOOST_CHECK(elements(b) == "0 1 2 3 4 5 6 7 8 9");
+    a.swap(small);
+    BOOST_CHECK(elements(a) == "1 2" && elements(small) == "1 2");
+    b.swap(large);
+    BOOST_CHECK(elements(b) == "0 1 2 3 4 5 6 7 8 9");
+  }
+  {
+    // SmallVector test 4
+    // Inserting a range of the vector into itself
+    SmallVector<int, 4> v;
+    v.push_back(1);
+    v.push_back(2);
+    v.push_back(3);
+    v.insert(v.begin() + 1, v.begin(), v.end());
+    BOOST_CHECK(elements(v) == "1 1 2 3 2 3");
+    v.insert(v.end(), v.begin(), v.end());
+    BOOST_CHECK(elements(v) == "1 1 2 3 2 3 1 1 2 3 2 3");
+    v.insert(v.begin(), v.begin() + 10, v.end());
+    BOOST_CHECK(elements(v) == "2 3 1 1 2 3 2 3 1 1 2 3 2 3");
+  }
+  {
+    // Range test 1
+    XYRange* r(new XYRange(10, 0, -3));
+    BOOST_CHECK(r->size() == 4);
+    BOOST_CHECK(r->toString(true) == "[ 10 7 4 1 ]");
+    BOOST_CHECK(r->tail()->toString(true) == "[ 7 4 1 ]");
+    BOOST_CHECK((new XYRange(0, 0))->size() == 0);
+
+    XY* xy(new XY(io));
+    parse("5 enum 0 [+] foldl 3 enum [1 +] pmap 4 enum a-aa 9 1 abc-bca !", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 10 [ 1 2 3 ] [ 0 9 2 3 ] ]");
+  }
+  {
+    // Stream test 1
+    XY* xy(new XY(io));
+    parse("1 [4 >] [] [1 +] punfold a-aa count ab-a 5 0 [0 <] [a-aa *] [1 +] punfold @ 0 [99 >] [gc] [1 +] punfold 0 [+] foldl", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 1 2 3 4 ] 25 4950 ]");
+  }
+  {
+    // Stream test 2
+    XY* xy(new XY(io));
+    parse("100 1 [10 >] [ab-aba +] [1 +] punfold 0 [a- 0 1 =] [] [1 +] punfold a-aa 2 ab-ba @ ab-a", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    ostringstream naturals;
+    for (int i = 0; i < XYStream::PRINT_LIMIT; ++i)
+      naturals << i << " ";
+    BOOST_CHECK(n1->toString(true) == "[ 100 [ 101 102 103 104 105 106 107 108 109 110 ] [ " + naturals.str() + "... ] ]");
+    BOOST_CHECK(dynamic_cast<XYSequence*>(xy->mX[1])->at(9)->toString(true) == "110");
+
+    // Elements computed beyond the limit are printed too
+    dynamic_cast<XYSequence*>(xy->mX[2])->at(XYStream::PRINT_LIMIT);
+    naturals << XYStream::PRINT_LIMIT << " ";
+    BOOST_CHECK(xy->mX[2]->toString(true) == "[ " + naturals.str() + "... ]");
+  }
+  {
+    // Stream test 3
+    XY* xy(new XY(io));
+    parse("10 [0 =] [] [1 -] punfold 5 [0 =] [] [a- +] punfold", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 10 9 8 7 6 5 4 3 2 1 ] [ 5 ... ] ]");
+  }
+  {
+    // Set test 1
+    XY* xy(new XY(io));
+    parse("[1 2 1 3 2.0] to-set a-aa 3 ? ab-ba a-aa 9 ? ab-ba a-aa [3 4] set-union ab-ba a-aa [3 2 4] set-intersection ab-ba [2] set-difference", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 2 3 [ 1 2 3 4 ] [ 2 3 ] [ 1 3 ] ]");
+  }
+  {
+    // Set test 2
+    XY* xy(new XY(io));
+    parse("9 0 [1 2 3] to-set puncons ab-b !", back_inserter(xy->mY));
+    XYError::code code = XYError::TYPE;
+    try {
+      xy->eval();
+    }
+    catch (XYError& e) {
+      code = e.mCode;
+    }
+    BOOST_CHECK(code == XYError::IMMUTABLE);
+  }
+  {
+    // Path set and get test 1
+    XY* xy(new XY(io));
+    parse("[[] 1] [[1 2] [3 4]] @ [[1 2] [3 4] [5 6]] a-aa 9 [[0 [2 1]]] abc-bca ! [[1 2] [3 4]] a-aa 0 [[] 0] abc-bca !", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ 2 4 ] [ 9 [ 3 4 ] [ 5 9 ] ] [ [ 0 2 ] [ 0 4 ] ] ]");
+  }
+  {
+    // Shared empty list test 1
+    XYList* l1(new XYList());
+    l1->mList.push_back(new XYInteger(1));
+    XYList* l2(new XYList());
+    l2->mList.push_back(new XYInteger(2));
+    BOOST_CHECK(l1->tail() == l2->tail());
+    BOOST_CHECK(l1->tail()->mImmutable);
+    BOOST_CHECK(!l1->mImmutable);
+
+    XY* xy(new XY(io));
+    parse("[1] puncons 5 , [2] puncons", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 1 [ 5 ] 2 [ ] ]");
+  }
+  {
+    // Immutable view test 1
+    XYList* l1(new XYList());
+    parse("1 2 3", back_inserter(l1->mList));
+    l1->mImmutable = true;
+    XYList* l2(new XYList());
+    l2->mList.push_back(new XYInteger(4));
+
+    XYSequence* views[] = { l1->tail(), new XYJoin(l2, l1) };
+    for (int i=0; i < 2; ++i) {
+      XY* xy(new XY(io));
+      xy->mX.push_back(new XYInteger(9));
+      xy->mX.push_back(new XYInteger(1));
+      xy->mX.push_back(views[i]);
+      parse("!", back_inserter(xy->mY));
+      XYError::code code = XYError::TYPE;
+      try {
+        xy->eval();
+      }
+      catch (XYError& e) {
+        code = e.mCode;
+      }
+      BOOST_CHECK(code == XYError::IMMUTABLE);
+    }
+    BOOST_CHECK(l1->toString(true) == "[ 1 2 3 ]");
+  }
+  {
+    // Lexer test 1
+    XY* xy(new XY(io));
+    parse("[ ** comment ** \"a\\\"b\" 1.5x -3 foo+* ab-ba 2ab ] \"x\\\"y\\\" 1.[\" tokenize", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ [ \"a\\\"b\" 1.5 x -3 foo+* ab-ba 2ab ] [ \"x\\\"y\\\"\" \"1.\" \"[\" ] ]");
+  }
+  {
+    // Image test 1
+    XY* xy(new XY(io));
+    parse("[1 2 [3]] foo set [+] bar set 1.5 -12345678901234567890 \"s\" ab-ba 3 enum dict 1 [a b] dict-put [1 2 2] to-set", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(save_image(xy, "testcf.image"));
+
+    XY* xy2(new XY(io));
+    BOOST_CHECK(load_image(xy2, "testcf.image"));
+    remove("testcf.image");
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    XYList* n2(new XYList(xy2->mX.begin(), xy2->mX.end()));
+    BOOST_CHECK(n1->toString(true) == n2->toString(true));
+
+    parse("ab-ba [a b] dict-get 2 3 bar; . foo;", back_inserter(xy2->mY));
+    xy2->eval();
+    XYList* n3(new XYList(xy2->mX.begin(), xy2->mX.end()));
+    BOOST_CHECK(n3->toString(true) == "[ 1.5 \"s\" -12345678901234567890 [ 0 1 2 ] [ 1 2 ] 1 5 [ 1 2 [ 3 ] ] ]");
+    BOOST_CHECK(!load_image(xy2, "testcf.image"));
+  }
+
+  {
+    // Serialize test 1
+    XY* xy(new XY(io));
+    install_image_primitives(xy);
+    XYList* inner(new XYList());
+    inner->mList.push_back(new XYInteger(mpz_class("-123456789012345678901234567890")));
+    XYObject* o(new XYObject());
+    o->addSlot("a", empty_list(), new XYString("v"), false);
+    XYList* outer(new XYList());
+    outer->mList.push_back(inner);
+    outer->mList.push_back(inner);
+    outer->mList.push_back(outer);
+    outer->mList.push_back(o);
+    xy->mX.push_back(outer);
+    parse("serialize deserialize", back_inserter(xy->mY));
+    xy->eval();
+
+    XYList* r(dynamic_cast<XYList*>(xy->mX.back()));
+    BOOST_CHECK(r && r != outer && r->mList.size() == 4);
+    BOOST_CHECK(r->mList[0] != inner && r->mList[0] == r->mList[1]);
+    BOOST_CHECK(r->mList[0]->toString(true) == "[ -123456789012345678901234567890 ]");
+    BOOST_CHECK(r->mList[2] == r);
+    BOOST_CHECK(r->mList[3]->getSlot("a")->mValue->toString(true) == "\"v\"");
+    BOOST_CHECK(!deserialize(xy, "cfvalue", 7));
+  }
+
+  {
+    // Serialize test 2
+    // Slices, joins and streams are checked when they are read back
+    XY* xy(new XY(io));
+    parse("[1 2 3] a-aa puncons ab-b ab-ba [4] , "
+          "1 [4 >] [] [1 +] punfold a-aa count ab-a a-aa puncons ab-b",
+          back_inserter(xy->mY));
+    xy->eval();
+    XYList* values(new XYList(xy->mX.begin(), xy->mX.end()));
+    string data;
+    BOOST_CHECK(serialize(xy, values, data));
+    XYObject* r(deserialize(xy, data.data(), data.size()));
+    BOOST_CHECK(r && r->toString(true) == "[ [ 2 3 ] [ 1 2 3 4 ] [ 1 2 3 4 ] [ 2 3 4 ] ]");
+
+    // A slice ending beyond its original
+    XYList* list(new XYList());
+    list->mList.push_back(new XYInteger(1));
+    list->mList.push_back(new XYInteger(2));
+    list->mList.push_back(new XYInteger(3));
+    BOOST_CHECK(serialize(xy, list->tail(), data));
+    string end;
+    int64_t bounds[] = { 1, 3 };
+    size_t at = data.find(string(reinterpret_cast<char const*>(bounds), sizeof(bounds)));
+    BOOST_CHECK(at != string::npos);
+    BOOST_CHECK(deserialize(xy, data.data(), data.size()));
+    bounds[1] = 9;
+    data.replace(at, sizeof(bounds), reinterpret_cast<char const*>(bounds), sizeof(bounds));
+    BOOST_CHECK(!deserialize(xy, data.data(), data.size()));
+
+    // A slice before the start of its original
+    BOOST_CHECK(serialize(xy, new XYSlice(list, -1, 2), data));
+    BOOST_CHECK(!deserialize(xy, data.data(), data.size()));
+
+    // A join that contains itself
+    XYJoin* join(new XYJoin(list, list));
+    join->mSequences.push_back(join);
+    BOOST_CHECK(serialize(xy, join, data));
+    BOOST_CHECK(!deserialize(xy, data.data(), data.size()));
+
+    // A slice of a join that contains the slice
+    join = new XYJoin(list, list);
+    XYSlice* slice(new XYSlice(join, 0, 1));
+    join->mSequences.push_back(slice);
+    BOOST_CHECK(serialize(xy, slice, data));
+    BOOST_CHECK(!deserialize(xy, data.data(), data.size()));
+
+    // A stream whose chunks form a loop
+    XYStream* stream(dynamic_cast<XYStream*>(xy->mX[2]));
+    BOOST_CHECK(stream && !stream->mChunk->mNextChunk);
+    XYStreamChunk* chunk(new XYStreamChunk(xy, 0, list, list, list, list));
+    chunk->mElements.assign(XYStreamChunk::CAPACITY, list);
+    chunk->mNextChunk = chunk;
+    BOOST_CHECK(serialize(xy, new XYStream(chunk, 0), data));
+    BOOST_CHECK(!deserialize(xy, data.data(), data.size()));
+  }
+
+  {
+    // Compiled pattern test 1
+    XY* xy(new XY(io));
+    parse("[ [a b] b a ] p set 1 2 p; ) 3 4 p; ) [c d] 0 p; ! 5 6 p; )", back_inserter(xy->mY));
+    xy->eval();
+    XYList* p(dynamic_cast<XYList*>(xy->mEnv["p"]));
+    BOOST_CHECK(p && p->mPattern && p->mPattern->unchanged(p));
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ 2 1 4 3 b a ]");
+  }
+
+  {
+    // Shuffle test 1
+    XY* xy(new XY(io));
+    parse("1 2 3 abc-bca ab-ba a-aa abc-abca ab-a abc-cb", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ 2 3 3 ]");
+    BOOST_CHECK((new XYShuffle("ab-ba"))->mShape == XYShuffle::SWAP);
+    BOOST_CHECK((new XYShuffle("abc-abca"))->mShape == XYShuffle::COPY);
+    BOOST_CHECK((new XYShuffle("ab-a"))->mShape == XYShuffle::DROP);
+    BOOST_CHECK((new XYShuffle("abc-bca"))->mShape == XYShuffle::GENERAL);
+  }
+
+  {
+    // Parse cache test 1
+    XY* xy(new XY(io));
+    parse("\"1 [ 2 ] a-aa\" a-aa tokenize parse ab-ba tokenize parse parse-cache-stats", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 3);
+    XYList* p1(dynamic_cast<XYList*>(xy->mX[0]));
+    XYList* p2(dynamic_cast<XYList*>(xy->mX[1]));
+    XYList* stats(dynamic_cast<XYList*>(xy->mX[2]));
+    BOOST_CHECK(p1 && p2 && p1 != p2 && p1->mList[1] != p2->mList[1]);
+    BOOST_CHECK(p1->toString(true) == "[ 1 [ 2 ] a-aa ]");
+    BOOST_CHECK(p2->toString(true) == "[ 1 [ 2 ] a-aa ]");
+    BOOST_CHECK(stats && stats->mList.size() == 4);
+    BOOST_CHECK(stats->mList[0]->toString(true) == "1");
+    BOOST_CHECK(stats->mList[1]->toString(true) == "1");
+    BOOST_CHECK(stats->mList[2]->toString(true) == "1");
+  }
+
+  {
+    // Native code test 1
+    XY* xy(new XY(io));
+    xy->mCompiledWords["inc"].mSource = "[ 1 + ]";
+    xy->mCompiledWords["inc"].mFunction = native_inc;
+    xy->mCompiledWords["inc2"].mSource = "[ 1 + inc . ]";
+    xy->mCompiledWords["inc2"].mFunction = native_inc2;
+    parse("[ 1 + ] inc set [1 + inc.] inc2 set 5 inc2.", back_inserter(xy->mY));
+    xy->eval();
+    XYList* inc2(dynamic_cast<XYList*>(xy->mEnv["inc2"]));
+    BOOST_CHECK(inc2 && inc2->mNative);
+    BOOST_CHECK(xy->mX.size() == 1 && xy->mX[0]->toString(true) == "7");
+
+    // Redefined words are interpreted
+    parse("[ 10 + ] inc set 5 inc2. [ 2 + inc . ] inc2 set 5 inc2.", back_inserter(xy->mY));
+    xy->eval();
+    inc2 = dynamic_cast<XYList*>(xy->mEnv["inc2"]);
+    BOOST_CHECK(inc2 && !inc2->mNative);
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ 7 16 17 ]");
+  }
+
+  {
+    // Hash-consing test 1
+    XY* xy(new XY(io));
+    xy->mInterner = new XYInterner(1000);
+    parse("\"[1 [2 x]] [1 [2 x]] 1\" tokenize parse", back_inserter(xy->mY));
+    xy->eval();
+    XYList* p(dynamic_cast<XYList*>(xy->mX.back()));
+    BOOST_CHECK(p && p->mList.size() == 3);
+    BOOST_CHECK(p->mList[0] == p->mList[1] && p->mList[0]->mImmutable);
+    XYList* l(dynamic_cast<XYList*>(p->mList[0]));
+    BOOST_CHECK(l && l->mList[0] == p->mList[2]);
+
+    // Appending to a shared list copies it
+    xy->mX.push_back(l);
+    parse("3 , a-aa count", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(l->toString(true) == "[ 1 [ 2 x ] ]");
+    BOOST_CHECK(xy->mX.back()->toString(true) == "3");
+  }
+
+  {
+    // Hash-consing test 2
+    XY* xy(new XY(io));
+    xy->mInterner = new XYInterner(1000);
+    parse("\"[1 2 3] a-aa 9 0 abc-bca ! [1 2 3] [[1 2] [1 2]] a-aa 7 [1 0] abc-bca ! [[1 2] [1 2]] "
+          "[[1 2] [1 2]] a-aa 0 abc-acb @ 9 0 abc-bca !\" tokenize parse", back_inserter(xy->mY));
+    xy->eval();
+    XYList* p(dynamic_cast<XYList*>(xy->mX.back()));
+    BOOST_CHECK(p && p->mList[0] == p->mList[6] && p->mList[7] == p->mList[13]);
+
+    // Writes go to copies of the shared literals
+    parse(".", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ [ 9 2 3 ] [ 1 2 3 ] [ [ 1 2 ] [ 7 2 ] ] [ [ 1 2 ] [ 1 2 ] ] [ [ 9 2 ] [ 1 2 ] ] ]");
+    BOOST_CHECK(p->mList[0]->toString(true) == "[ 1 2 3 ]");
+  }
+
+  {
+    // Hash-consing test 3
+    XY* xy(new XY(io));
+    xy->mInterner = new XYInterner(1000);
+    parse("\"[1 2 3]\" tokenize parse", back_inserter(xy->mY));
+    xy->eval();
+    XYList* p(dynamic_cast<XYList*>(xy->mX.back()));
+    BOOST_CHECK(p && p->mList[0]->mImmutable);
+
+    // Evaluating a literal copies it, but the list from 'parse' holds
+    // the shared literal and a slice of it can't write to it.
+    XYError::code code = XYError::TYPE;
+    try {
+      parse("a-aa . ab-ba 0 ab-ba @ puncons ab-b 9 0 abc-bca !", back_inserter(xy->mY));
+      xy->eval();
+    }
+    catch (XYError& e) {
+      code = e.mCode;
+    }
+    BOOST_CHECK(code == XYError::IMMUTABLE);
+    BOOST_CHECK(p->mList[0]->toString(true) == "[ 1 2 3 ]");
+    BOOST_CHECK(!xy->mX[0]->mImmutable && xy->mX[0]->toString(true) == "[ 1 2 3 ]");
+  }
+
+  {
+    // Print shared test 1
+    // A list shared many times is printed once
+    XYList* l(new XYList());
+    l->mList.push_back(new XYInteger(1));
+    for (int i=0; i < 40; ++i) {
+      XYList* pair(new XYList());
+      pair->mList.push_back(l);
+      pair->mList.push_back(l);
+      l = pair;
+    }
+    BOOST_CHECK(l->toString(true).size() < 1000);
+  }
+
+  {
+    // Pattern missing variables test 1
+    XY* xy(new XY(io));
+    parse("[ 1 ] [ [ [ a b c ] ] [ b c ] ] )", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(dynamic_cast<XYList*>(xy->mX.back()));
+    BOOST_CHECK(n1 && n1->toString(true) == "[ [ ] [ ] ]");
+    BOOST_CHECK(n1 && n1->mList[0] != n1->mList[1]);
+  }
+  {
+    // Streaming loader test 1
+    {
+      ofstream out("testcf.lcf");
+      out << "Text\n> 1 2 [ 3\n>  4 ] ** a\n> b ** \"c\n>d\"\n\\begin{code}\n[ 5\n6 ] ab-ba\n\\end{code}\n[ 7 ]\n";
+    }
+    XY* xy(new XY(io));
+    load_file(xy, "testcf.lcf");
+    remove("testcf.lcf");
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ 1 2 [ 3 4 ] [ 5 6 ] \"c\\nd\" ]");
+  }
+  {
+    // Streaming loader test 2
+    XY* xy(new XY(io));
+    {
+      ofstream out("testcf.cf");
+      out << "[ a-aa ] $\n4 5\n";
+    }
+    load_file(xy, "testcf.cf");
+    {
+      ofstream out("testcf.cf");
+      out << "1 2 '\n3\n";
+    }
+    load_file(xy, "testcf.cf");
+    remove("testcf.cf");
+    XYList* n(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n->toString(true) == "[ 4 5 4 5 1 2 [ 3 ] ]");
+  }
 
 }
 
@@ -414,18 +1063,183 @@ void testObjects(boost::asio::io_service& io)
 
     cout << o1 ->toString(true) << endl;
     cout << o2 ->toString(true) << endl;
-    set<XYObject*> circular1;
     XYObject* context1 = 0;
-    BOOST_CHECK(o1->lookup("b", circular1, &context1) == o2->getSlot("b"));
+    BOOST_CHECK(o1->lookup("b", &context1) == o2->getSlot("b"));
     BOOST_CHECK(context1 == o2);
 
-    set<XYObject*> circular2;
     XYObject* context2 = 0;
-    BOOST_CHECK(o1->lookup("a", circular2, &context2) == o1->getSlot("a"));
+    BOOST_CHECK(o1->lookup("a", &context2) == o1->getSlot("a"));
     BOOST_CHECK(context2 == o1);
 
-    set<XYObject*> circular3;
-    BOOST_CHECK(o1->lookup("c", circular3, 0) == 0);
+    BOOST_CHECK(o1->lookup("c", 0) == 0);
+
+    // Circular parents
+    o2->addSlot("parent", m, o1, true);
+    BOOST_CHECK(o1->lookup("c", 0) == 0);
+    BOOST_CHECK(o2->lookup("a", 0) == o1->getSlot("a"));
+  }
+
+  {
+    // Shape test 1
+    XYObject* m = new XYList();
+    XYObject* o1 = new XYObject();
+    XYObject* o2 = new XYObject();
+    o1->addSlot("a", m, new XYInteger(1), false);
+    o1->addSlot("b", m, new XYInteger(2), false);
+    o2->addSlot("a", m, new XYInteger(3), false);
+    o2->addSlot("b", m, new XYInteger(4), false);
+    BOOST_CHECK(o1->mShape == o2->mShape);
+    BOOST_CHECK(o1->mShape != XYShape::empty());
+
+    XYObject* o3 = o1->copy();
+    BOOST_CHECK(o3->mShape == o1->mShape);
+    BOOST_CHECK(o3->getSlot("b")->mValue == o1->getSlot("b")->mValue);
+
+    o3->removeSlot("a");
+    BOOST_CHECK(!o3->getSlot("a"));
+    BOOST_CHECK(o3->getSlot("b")->mValue->toString(true) == "2");
+    BOOST_CHECK(o3->mShape->mDictionary);
+    BOOST_CHECK(o3->mShape->mNames.size() == 1 && o3->mShape->find("b") == 0);
+    BOOST_CHECK(!o1->mShape->mDictionary && o1->mShape->find("a") == 0);
+    BOOST_CHECK(o1->getSlot("a")->mValue->toString(true) == "1");
+
+    // Copies share slots until one is changed
+    XYObject* o4 = o1->copy();
+    BOOST_CHECK(o4->mSlots == o1->mSlots);
+    o4->setSlotValue(o4->mShape->find("a"), new XYInteger(5));
+    BOOST_CHECK(o4->mSlots != o1->mSlots);
+    BOOST_CHECK(o4->getSlot("a")->mValue->toString(true) == "5");
+    BOOST_CHECK(o1->getSlot("a")->mValue->toString(true) == "1");
+    BOOST_CHECK(o4->getSlot("b")->mValue == o1->getSlot("b")->mValue);
+  }
+
+  {
+    // Shape test 2
+    // Objects with many slots get a shape of their own instead of
+    // adding a shared shape for every slot.
+    XYObject* m = new XYList();
+    XYObject* p = new XYObject();
+    XYObject* o1 = new XYObject();
+    XYShape* shared = 0;
+    for (int i = 0; i < 2000; ++i) {
+      string name = "s" + lexical_cast<string>(i);
+      o1->addSlot(name, m, new XYInteger(i), i == 1000);
+      if (i == XYShape::MAX_SHARED_SLOTS - 1)
+        shared = o1->mShape;
+    }
+    BOOST_CHECK(!shared->mDictionary);
+    BOOST_CHECK(shared->mTransitions.size() == 0);
+    BOOST_CHECK(o1->mShape->mDictionary);
+    BOOST_CHECK(o1->mShape->mNames.size() == 2000);
+    BOOST_CHECK(o1->getSlot("s1999")->mValue->toString(true) == "1999");
+    BOOST_CHECK(o1->mShape->mParents.size() == 1 && o1->mShape->mParents[0] == 1000);
+
+    // Copies get their own dictionary shape
+    XYObject* o2 = o1->copy();
+    BOOST_CHECK(o2->mShape != o1->mShape);
+    o2->removeSlot("s5");
+    BOOST_CHECK(o1->getSlot("s5") && !o2->getSlot("s5"));
+    BOOST_CHECK(o2->getSlot("s6")->mValue->toString(true) == "6");
+    BOOST_CHECK(o2->getSlot("s1999")->mValue->toString(true) == "1999");
+    BOOST_CHECK(o2->mShape->mParents.size() == 1 && o2->mShape->mParents[0] == 999);
+
+    // Lookups through a dictionary shape see slots added later
+    XYSymbol* name = new XYSymbol("x");
+    BOOST_CHECK(name->lookupSlot(o2, 0) == 0);
+    p->addSlot("x", m, new XYInteger(1), false);
+    o2->setSlotValue(o2->mShape->find("s1000"), p);
+    BOOST_CHECK(name->lookupSlot(o2, 0) == p->getSlot("x"));
+    o2->addSlot("x", m, new XYInteger(2), false);
+    BOOST_CHECK(name->lookupSlot(o2, 0) == o2->getSlot("x"));
+    o2->removeSlot("x");
+    BOOST_CHECK(name->lookupSlot(o2, 0) == p->getSlot("x"));
+
+    // A shape with many transitions stops adding shared shapes
+    XYShape* base = XYShape::empty()->add("transitions", false);
+    for (int i = 0; i < XYShape::MAX_TRANSITIONS + 10; ++i)
+      base->add("t" + lexical_cast<string>(i), false);
+    BOOST_CHECK(base->mTransitions.size() == XYShape::MAX_TRANSITIONS);
+    BOOST_CHECK(base->add("t0", false) == base->add("t0", false));
+    BOOST_CHECK(base->add("t70", false)->mDictionary);
+  }
+
+  {
+    // Lookup cache test 1
+    XYObject* m = new XYList();
+    XYObject* p1 = new XYObject();
+    XYObject* p2 = new XYObject();
+    XYObject* o1 = new XYObject();
+    p2->addSlot("a", m, new XYInteger(1), false);
+    p1->addSlot("parent", m, p2, true);
+    o1->addSlot("parent", m, p1, true);
+
+    XYSymbol* name = new XYSymbol("a");
+    XYObject* context = 0;
+    BOOST_CHECK(name->lookupSlot(o1, &context) == p2->getSlot("a"));
+    BOOST_CHECK(context == p2);
+    BOOST_CHECK(name->lookupSlot(o1->copy(), 0) == p2->getSlot("a"));
+
+    // Adding a slot to a parent that was searched invalidates the entry
+    p1->addSlot("a", m, new XYInteger(2), false);
+    BOOST_CHECK(name->lookupSlot(o1, &context) == p1->getSlot("a"));
+    BOOST_CHECK(context == p1);
+
+    // Changing the receiver's parent slot misses the entry
+    o1->setSlotValue(o1->mShape->find("parent"), p2);
+    BOOST_CHECK(name->lookupSlot(o1, 0) == p2->getSlot("a"));
+    BOOST_CHECK(name->lookupSlot(new XYObject(), 0) == 0);
+
+    XYString* name2 = new XYString("a");
+    BOOST_CHECK(name2->lookupSlot(o1, 0) == p2->getSlot("a"));
+    name2->mValue = "parent";
+    BOOST_CHECK(name2->lookupSlot(o1, 0) == o1->getSlot("parent"));
+  }
+
+  {
+    // Call method test 1
+    XY* xy(new XY(io));
+    parse("5 2 object copy [x y] [ x. y. - ] sub add-method sub;. "
+          "5 2 object copy [x y] [ frame ] f add-method f;.",
+          back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 2);
+    BOOST_CHECK(xy->mX[0]->toString(true) == "3");
+
+    XYObject* frame = xy->mX[1];
+    BOOST_CHECK(frame->getSlot("x")->mValue->toString(true) == "5");
+    BOOST_CHECK(frame->getSlot("y")->mValue->toString(true) == "2");
+    BOOST_CHECK(frame->getSlot("self")->mValue->getSlot("f"));
+    BOOST_CHECK(frame->mShape->mParent[frame->mShape->find("self")]);
+    BOOST_CHECK(frame->mShape->find("self:") < 0);
+  }
+
+  {
+    // Call method test 2
+    XY* xy(new XY(io));
+    parse("1 2 call-method", back_inserter(xy->mY));
+    XYError::code code = XYError::TYPE;
+    try {
+      xy->eval();
+    }
+    catch (XYError& e) {
+      code = e.mCode;
+    }
+    BOOST_CHECK(code == XYError::SLOT_NOT_FOUND);
+  }
+
+  {
+    // Slot accessor test 1
+    XY* xy(new XY(io));
+    parse("object copy 42 foo add-slot a set "
+          "25 a; foo:;. foo;. "
+          "a; [] [ foo. 1 + ] inc add-method inc;. "
+          "a; foo;",
+          back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 4);
+    BOOST_CHECK(xy->mX[0]->toString(true) == "25");
+    BOOST_CHECK(xy->mX[1]->toString(true) == "26");
+    BOOST_CHECK(xy->mX[3]->toString(true) == "[ \"foo\" get-slot-value ]");
   }
 }
 
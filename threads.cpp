@@ -74,7 +74,9 @@ static void primitive_make_thread(XY* xy) {
   xy->mX.pop_back();
 
   XY* child(new XY(xy->mService));
-  stack->pushBackInto(child->mX);
+  XYSequence::List stemp;
+  stack->pushBackInto(stemp);
+  child->mX.assign(stemp.begin(), stemp.end());
 
   XYSequence::List temp;
   queue->pushBackInto(temp);
@@ -82,6 +84,9 @@ static void primitive_make_thread(XY* xy) {
 
   child->mEnv = xy->mEnv;
   child->mP = xy->mP;
+  child->mParseCache = xy->mParseCache;
+  child->mCompiledWords = xy->mCompiledWords;
+  child->mInterner = xy->mInterner;
   child->mLimits = xy->mLimits;
 
   XYThread* thread(new XYThread(child, xy));
@@ -107,7 +112,9 @@ static void primitive_make_limited_thread(XY* xy) {
   xy->mX.pop_back();
 
   XY* child(new XY(xy->mService));
-  stack->pushBackInto(child->mX);
+  XYSequence::List stemp;
+  stack->pushBackInto(stemp);
+  child->mX.assign(stemp.begin(), stemp.end());
 
   XYSequence::List temp;
   queue->pushBackInto(temp);
@@ -115,6 +122,9 @@ static void primitive_make_limited_thread(XY* xy) {
 
   child->mEnv = xy->mEnv;
   child->mP = xy->mP;
+  child->mParseCache = xy->mParseCache;
+  child->mCompiledWords = xy->mCompiledWords;
+  child->mInterner = xy->mInterner;
   child->mLimits = xy->mLimits;
 
   child->mLimits.push_back(new XYTimeLimit(ms->as_uint()));